@@ -0,0 +1,228 @@
+// cobra_bench: synthetic workloads for the renderer. every workload prints one json object per line on stdout,
+// so runs from different versions can be diffed or fed to a script.
+#define COBRA_NO_MAIN
+#include "cobra.cpp"
+
+struct Bench {
+	std::function<void (Renderer &)> draw;
+	Vector4 eye, at;
+	long long triangles; // submitted per frame, before any culling
+	double load; // seconds spent loading files, 0 for generated meshes
+};
+
+std::shared_ptr<Mesh> SphereMesh (int rings, int segments) {
+	auto mesh = std::make_shared<Mesh> ();
+	for (int r = 0; r <= rings; r++) {
+		for (int s = 0; s <= segments; s++) {
+			float theta = (float)M_PI * r / rings, phi = 2 * (float)M_PI * s / segments;
+			Vector4 n = { std::sin (theta) * std::cos (phi), std::cos (theta), -std::sin (theta) * std::sin (phi), 0 };
+			mesh->posBuffer.push_back ({ n.x, n.y, n.z, 1 });
+			mesh->normalBuffer.push_back (n);
+			mesh->uvBuffer.push_back ({ (float)s / segments, 1 - (float)r / rings, 0, 0 });
+		}
+	}
+	for (int r = 0; r < rings; r++) {
+		for (int s = 0; s < segments; s++) {
+			uint32_t a = r * (segments + 1) + s, b = a + segments + 1;
+			uint32_t quad[6] = { a, b, a + 1, a + 1, b, b + 1 };
+			mesh->indexBuffer.insert (mesh->indexBuffer.end (), quad, quad + 6);
+		}
+	}
+	mesh->hasUv = true;
+	mesh->ComputeBounds ();
+	return mesh;
+} // unit sphere, 2 * rings * segments triangles
+
+std::shared_ptr<Mesh> QuadMesh () {
+	auto mesh = std::make_shared<Mesh> ();
+	mesh->posBuffer = { { -1, -1, 0, 1 }, { 1, -1, 0, 1 }, { 1, 1, 0, 1 }, { -1, 1, 0, 1 } };
+	mesh->normalBuffer.assign (4, { 0, 0, 1, 0 });
+	mesh->uvBuffer = { { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 1, 1, 0, 0 }, { 0, 1, 0, 0 } };
+	mesh->indexBuffer = { 0, 1, 2, 0, 2, 3 };
+	mesh->hasUv = true;
+	mesh->ComputeBounds ();
+	return mesh;
+} // [-1, 1] square in the xy plane, facing +z
+
+std::shared_ptr<Mesh> SliverMesh (int count) {
+	auto mesh = std::make_shared<Mesh> ();
+	for (int i = 0; i < count; i++) {
+		float y = -1 + 2.0f * i / count, h = 0.005f; // about a pixel high at the bench camera, spanning the whole width
+		uint32_t base = (uint32_t)mesh->posBuffer.size ();
+		mesh->posBuffer.push_back ({ -1, y, 0, 1 });
+		mesh->posBuffer.push_back ({ 1, y, 0, 1 });
+		mesh->posBuffer.push_back ({ -1, y + h, 0, 1 });
+		for (int k = 0; k < 3; k++) mesh->normalBuffer.push_back ({ 0, 0, 1, 0 }), mesh->uvBuffer.push_back ({ 0.5f, 0.5f, 0, 0 });
+		mesh->indexBuffer.insert (mesh->indexBuffer.end (), { base, base + 1, base + 2 });
+	}
+	mesh->hasUv = true;
+	mesh->ComputeBounds ();
+	return mesh;
+} // long thin triangles, most blocks they touch are partially covered
+
+std::shared_ptr<const Texture> CheckerTexture (int size, int cell) {
+	std::vector<uint32_t> texels (size * size);
+	for (int y = 0; y < size; y++)
+		for (int x = 0; x < size; x++) texels[y * size + x] = ((x / cell + y / cell) & 1) ? 0xffe0c0a0 : 0xff402010;
+	auto texture = std::make_shared<Texture> ();
+	CreateTexture (*texture, size, size, texels.data ());
+	return texture;
+}
+
+Bench DrawMeshBench (std::shared_ptr<const Mesh> mesh, Material material, bool drawTex, bool drawWireFrame) {
+	Model model (mesh, CreateModelMatrix ({ 0, 0, 0 }), material);
+	return{ [=] (Renderer &r) { r.DrawModel (model, drawTex, drawWireFrame); }, { 0, 0, 2.5f }, { 0, 0, 0 }, (long long)mesh->indexBuffer.size () / 3, 0 };
+}
+
+Bench SphereBench (int rings, int segments, bool drawTex, bool drawWireFrame, bool meshlets = false) {
+	std::shared_ptr<Mesh> mesh = SphereMesh (rings, segments);
+	if (meshlets) mesh->BuildMeshlets (); // what cobra_convert does, the back half is culled before the vertex stage
+	return DrawMeshBench (mesh, { 0.1f, 0.9f, 0.5f, CheckerTexture (256, 16) }, drawTex, drawWireFrame);
+}
+
+Bench OverdrawBench (int layers) {
+	std::shared_ptr<const Mesh> quad = QuadMesh ();
+	std::vector<Instance> instances;
+	for (int i = 0; i < layers; i++) instances.push_back ({ CreateModelMatrix ({ 0, 0, -0.1f * (layers - i) }, { 0, 0, 0 }, { 4, 4, 1 }), { 0.2f, 0.8f, 0.2f } });
+	return{ [=] (Renderer &r) { r.DrawInstanced (*quad, instances); }, { 0, 0, 1 }, { 0, 0, 0 }, 2LL * layers, 0 };
+} // full screen quads drawn back to front, every layer passes the depth test
+
+Bench TextureBench (int textureSize, int grid) {
+	std::shared_ptr<const Mesh> quad = QuadMesh ();
+	Material material = { 0.2f, 0.8f, 0.2f, CheckerTexture (textureSize, std::max (1, textureSize / 16)) };
+	std::vector<Instance> instances;
+	for (int y = 0; y < grid; y++)
+		for (int x = 0; x < grid; x++)
+			instances.push_back ({ CreateModelMatrix ({ (x + 0.5f) * 2.0f / grid - 1, (y + 0.5f) * 2.0f / grid - 1, 0 }, { 0, 0, 0 }, { 1.0f / grid, 1.0f / grid, 1 }), material });
+	return{ [=] (Renderer &r) { r.DrawInstanced (*quad, instances); }, { 0, 0, 1 }, { 0, 0, 0 }, 2LL * grid * grid, 0 };
+} // a grid of quads filling the screen, a small texture is magnified, a big one minified
+
+Bench OcclusionBench (int rings, int segments) {
+	std::shared_ptr<const Mesh> quad = QuadMesh (), sphere = SphereMesh (rings, segments);
+	Model wall (quad, CreateModelMatrix ({ -1.0f, 0, 0.5f }, { 0, 0, 0 }, { 1.5f, 2, 1 }), { 0.2f, 0.8f, 0.2f });
+	std::vector<Instance> instances = { { CreateModelMatrix ({ -2.0f, 0, -1.0f }), { 0.1f, 0.9f, 0.5f } }, { CreateModelMatrix ({ 1.5f, 0, -1.0f }), { 0.1f, 0.9f, 0.5f } } };
+	return{ [=] (Renderer &r) { r.DrawModel (wall); r.DrawInstanced (*sphere, instances); }, { 0, 0, 2.5f }, { 0, 0, 0 },
+		2 + 2LL * (long long)sphere->indexBuffer.size () / 3, 0 };
+} // a wall drawn first, one sphere completely behind it and one half behind its edge
+
+Bench LightsBench (int count) {
+	std::shared_ptr<const Mesh> quad = QuadMesh ();
+	Model model (quad, CreateModelMatrix ({ 0, 0, 0 }, { 0, 0, 0 }, { 4, 4, 1 }), { 0.2f, 0.8f, 0.5f });
+	std::vector<PointLight> lights;
+	uint32_t seed = 1;
+	auto random = [&] { seed = seed * 1664525u + 1013904223u; return (seed >> 8) * (1.0f / 16777216.0f); };
+	for (int i = 0; i < count; i++) lights.push_back ({ { random () * 4 - 2, random () * 3 - 1.5f, 0.1f, 1 }, { random (), random (), random (), 0 }, 0.25f });
+	return{ [=] (Renderer &r) { r.SetLights (lights); r.DrawModel (model); }, { 0, 0, 1 }, { 0, 0, 0 }, 2, 0 };
+} // one full screen quad under many small lights, the shading cost follows the lights per tile, not the total
+
+Bench LoadBench (int n, bool binary) {
+	// a n x n grid written as text, then loaded like any other obj file. or converted first and loaded from the binary file
+	std::string file = "cobra_bench.obj";
+	{
+		std::ofstream ofs (file);
+		for (int y = 0; y <= n; y++)
+			for (int x = 0; x <= n; x++) ofs << "v " << 2.0f * x / n - 1 << " " << 2.0f * y / n - 1 << " 0\n";
+		for (int y = 0; y <= n; y++)
+			for (int x = 0; x <= n; x++) ofs << "vt " << (float)x / n << " " << (float)y / n << "\n";
+		ofs << "vn 0 0 1\n";
+		for (int y = 0; y < n; y++) {
+			for (int x = 0; x < n; x++) {
+				int a = y * (n + 1) + x + 1, b = a + n + 1;
+				ofs << "f " << a << "/" << a << "/1 " << a + 1 << "/" << a + 1 << "/1 " << b + 1 << "/" << b + 1 << "/1 " << b << "/" << b << "/1\n";
+			}
+		}
+	}
+	if (binary) {
+		Mesh obj (file);
+		obj.BuildMeshlets ();
+		std::remove (file.c_str ());
+		file = "cobra_bench.cmesh";
+		obj.SaveBinary (file);
+	}
+	auto start = std::chrono::steady_clock::now ();
+	std::shared_ptr<const Mesh> mesh = std::make_shared<const Mesh> (file);
+	double load = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+	std::remove (file.c_str ());
+	Bench bench = DrawMeshBench (mesh, { 0.2f, 0.8f, 0.2f, CheckerTexture (512, 32) }, true, false);
+	bench.eye = { 0, 0, 1 }, bench.load = load;
+	return bench;
+} // quads are split into two triangles by the loader
+
+int main (int argc, char *argv[]) {
+	int width = 1024, height = 768, frames = 5, threads = 0;
+	std::string only;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp (argv[i], "-frames") && i + 1 < argc) frames = std::max (1, atoi (argv[++i]));
+		else if (!strcmp (argv[i], "-size") && i + 1 < argc) sscanf (argv[++i], "%dx%d", &width, &height);
+		else if (!strcmp (argv[i], "-only") && i + 1 < argc) only = argv[++i]; // run a single workload
+		else threads = atoi (argv[i]); // "cobra_bench 8" renders with 8 threads
+	}
+
+	struct Workload { const char *name; std::function<Bench ()> setup; };
+	const Workload workloads[] = {
+		{ "sphere_2k", [] { return SphereBench (32, 32, true, false); } },
+		{ "sphere_200k", [] { return SphereBench (250, 400, true, false); } },
+		{ "sphere_2m", [] { return SphereBench (1000, 1000, true, false); } },
+		{ "meshlets_2m", [] { return SphereBench (1000, 1000, true, false, true); } },
+		{ "overdraw_32", [] { return OverdrawBench (32); } },
+		{ "slivers_100k", [] { return DrawMeshBench (SliverMesh (100000), { 0.2f, 0.8f, 0.2f }, true, false); } },
+		{ "texture_magnified", [] { return TextureBench (16, 4); } },
+		{ "texture_minified", [] { return TextureBench (1024, 32); } },
+		{ "occluded_200k", [] { return OcclusionBench (250, 200); } },
+		{ "lights_16", [] { return LightsBench (16); } },
+		{ "lights_1024", [] { return LightsBench (1024); } },
+		{ "wireframe_200k", [] { return SphereBench (250, 400, false, true); } },
+		{ "load_obj_500k", [] { return LoadBench (500, false); } },
+		{ "load_cmesh_500k", [] { return LoadBench (500, true); } },
+	};
+
+	for (auto &workload : workloads) {
+		if (!only.empty () && only != workload.name) continue;
+		Bench bench = workload.setup ();
+
+		// deferred mode keeps rasterization and shading apart, so both can be timed
+		Renderer renderer (width, height);
+		if (threads > 0) renderer.SetThreadCount (threads);
+		renderer.SetDeferred (true);
+		renderer.SetFrustum ((float)M_PI_2, (float)width / (float)height, 0.1f, 1000.0f);
+		renderer.SetCamera (bench.eye, bench.at);
+		renderer.SetLight ({ -10.0f, 30.0f, 30.0f }, { 0.5f, 0.0f, 0.0f, 0 }, { 0.8f, 0.8f, 0.8f, 0 }, { 0.5f, 0.5f, 0.5f, 0 });
+
+		double output = 0, best = 1e30;
+		long long pixels = 0;
+		bench.draw (renderer); // warm up, the vertex cache and tile bins grow to their final size here
+		renderer.Resolve ();
+		Renderer::RenderStats t = {};
+		for (int f = 0; f < frames; f++) {
+			renderer.Clear ();
+			bench.draw (renderer);
+			for (auto &id : renderer.idBuffer) pixels += id.draw != Renderer::NO_DRAW; // not timed
+			renderer.Resolve ();
+			auto start = std::chrono::steady_clock::now ();
+			SaveImage (renderer.frameBuffer, "cobra_bench.bmp");
+			double write = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+			const Renderer::RenderStats &frame = renderer.stats;
+			output += write;
+			best = std::min (best, frame.vertexTime + frame.rasterTime + frame.shadeTime + write);
+			t += frame;
+		}
+		std::remove ("cobra_bench.bmp");
+
+		double render = (t.vertexTime + t.rasterTime + t.shadeTime) / frames;
+		printf ("{\"workload\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, \"frames\": %d, \"triangles\": %lld, \"pixels\": %lld, "
+			"\"load_ms\": %.3f, \"vertex_ms\": %.3f, \"raster_ms\": %.3f, \"shade_ms\": %.3f, \"output_ms\": %.3f, \"best_frame_ms\": %.3f, "
+			"\"triangles_per_s\": %.0f, \"pixels_per_s\": %.0f, \"models_occluded\": %lld, \"triangles_occluded\": %lld, "
+			"\"vertices_shaded\": %lld, \"meshlets_culled\": %lld",
+			workload.name, width, height, renderer.pool.Size (), frames, bench.triangles, pixels / frames,
+			bench.load * 1e3, t.vertexTime / frames * 1e3, t.rasterTime / frames * 1e3, t.shadeTime / frames * 1e3, output / frames * 1e3, best * 1e3,
+			bench.triangles / render, pixels / frames / render, t.modelsOccluded / frames, t.trianglesOccluded / frames,
+			t.verticesShaded / frames, (t.meshletsOutside + t.meshletsBackface) / frames);
+#if COBRA_STATS
+		printf (", \"triangles_rasterized\": %lld, \"blocks_occluded\": %lld, \"pixels_tested\": %lld, \"pixels_covered\": %lld, \"pixels_depth_rejected\": %lld, \"pixels_shaded\": %lld, \"texture_samples\": %lld",
+			t.trianglesRasterized / frames, t.blocksOccluded / frames, t.pixelsTested / frames, t.pixelsCovered / frames, t.pixelsDepthRejected / frames, t.pixelsShaded / frames, t.textureSamples / frames);
+#endif
+		printf ("}\n");
+		fflush (stdout);
+	}
+	return 0;
+} // stage times are per frame averages, the rates are taken over vertex + raster + shade
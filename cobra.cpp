@@ -1,18 +1,86 @@
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
+#if defined(COBRA_SCALAR) // plain c++ everywhere, the reference the simd paths are checked against
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define COBRA_AVX2
+#define COBRA_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COBRA_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef COBRA_STATS
+#define COBRA_STATS 0 // 1 compiles in the per pixel counters of Renderer::stats and the heat map
+#endif
+#if COBRA_STATS
+#define COBRA_STAT(statement) statement
+#else
+#define COBRA_STAT(statement)
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-struct Vector4 {
+// math. with COBRA_SSE2 a Vector4 is one sse register and a Matrix4 row is another. every simd function does the
+// same operations in the same order as the scalar code, one lane per component, so the results are bit identical,
+// with two exceptions:
+//   - TransformPoint () and ClipToScreen () multiply by 1 / w instead of dividing by w, in both builds. that is
+//     within 1 ulp of the division, and exact for w == 1.
+//   - Matrix4::Invert () uses cramer's rule in a different order. its results stay within 1e-6 relative error
+//     (per element, against the largest element of the matrix) of the scalar version for rigid and scaled transforms.
+// build with COBRA_SCALAR to get the scalar reference. loads and stores are unaligned: std::vector does not honor
+// alignas before c++17 and 32 bit heaps only promise 8 bytes. on aligned data they cost the same as aligned ones.
+struct alignas (16) Vector4 {
 	float x, y, z, w;
+#if defined(COBRA_SSE2)
+	__m128 Load () const { return _mm_loadu_ps (&x); }
+	static Vector4 Store (__m128 v) {
+		Vector4 r;
+		_mm_storeu_ps (&r.x, v);
+		return r;
+	}
+	Vector4 operator- () const { return Store (_mm_xor_ps (Load (), _mm_set1_ps (-0.0f))); } // flips the sign bit, like scalar negation
+	Vector4 operator+ (const Vector4 &rhs) const { return Store (_mm_add_ps (Load (), rhs.Load ())); }
+	Vector4 operator- (const Vector4 &rhs) const { return Store (_mm_sub_ps (Load (), rhs.Load ())); }
+	Vector4 operator* (const Vector4 &rhs) const { return Store (_mm_mul_ps (Load (), rhs.Load ())); }
+	Vector4 operator* (float f) const { return Store (_mm_mul_ps (Load (), _mm_set1_ps (f))); }
+#else
 	Vector4 operator- () const { return{ -x, -y, -z, -w }; }
 	Vector4 operator+ (const Vector4 &rhs) const { return{ x + rhs.x, y + rhs.y, z + rhs.z, w + rhs.w }; }
 	Vector4 operator- (const Vector4 &rhs) const { return{ x - rhs.x, y - rhs.y, z - rhs.z, w - rhs.w }; }
 	Vector4 operator* (const Vector4 &rhs) const { return{ x* rhs.x, y * rhs.y, z * rhs.z, w * rhs.w }; }
 	Vector4 operator* (float f) const { return{ x * f, y * f, z * f, w * f }; }
+#endif
 	Vector4 Cross (const Vector4 &rhs) const { return{ y * rhs.z - z * rhs.y, z * rhs.x - x * rhs.z, x * rhs.y - y * rhs.x }; }
 	float Dot (const Vector4 &rhs) const { return (x * rhs.x + y * rhs.y + z * rhs.z); }
 	Vector4 Normalize () const {
@@ -21,13 +89,107 @@ struct Vector4 {
 	};
 }; // we use vecter4 representing position/direction/uv/color etc.
 
-struct Matrix4 {
+struct alignas (16) Matrix4 {
 	float m[4][4];
 	Matrix4 () {
 		memset (m, 0, sizeof (m));
 		m[0][0] = m[1][1] = m[2][2] = m[3][3] = 1.0f;
 	}
 
+#if defined(COBRA_SSE2)
+	__m128 Row (int i) const { return _mm_loadu_ps (m[i]); }
+
+	__m128 Combine (__m128 x, __m128 y, __m128 z, __m128 w) const {
+		return _mm_add_ps (_mm_add_ps (_mm_add_ps (_mm_mul_ps (x, Row (0)), _mm_mul_ps (y, Row (1))), _mm_mul_ps (z, Row (2))), _mm_mul_ps (w, Row (3)));
+	} // x * row0 + y * row1 + z * row2 + w * row3, a row vector times this matrix
+
+	__m128 Combine (__m128 x, __m128 y, __m128 z) const {
+		return _mm_add_ps (_mm_add_ps (_mm_mul_ps (x, Row (0)), _mm_mul_ps (y, Row (1))), _mm_mul_ps (z, Row (2)));
+	} // same for w == 0
+
+	Matrix4 operator* (const Matrix4 &rhs) const {
+		Matrix4 t;
+		for (int i = 0; i < 4; i++)
+			_mm_storeu_ps (t.m[i], rhs.Combine (_mm_set1_ps (m[i][0]), _mm_set1_ps (m[i][1]), _mm_set1_ps (m[i][2]), _mm_set1_ps (m[i][3])));
+		return t;
+	} // row i of the product is row i of this matrix times rhs
+
+	void Invert () {
+		// cramer's rule on the transposed matrix, the 2x2 sub-determinants are shared between the four cofactor rows
+		float *src = &m[0][0];
+		__m128 minor0, minor1, minor2, minor3, row0, row1, row2, row3, det, tmp1;
+		tmp1 = _mm_loadh_pi (_mm_loadl_pi (_mm_setzero_ps (), (const __m64 *)(src)), (const __m64 *)(src + 4));
+		row1 = _mm_loadh_pi (_mm_loadl_pi (_mm_setzero_ps (), (const __m64 *)(src + 8)), (const __m64 *)(src + 12));
+		row0 = _mm_shuffle_ps (tmp1, row1, 0x88);
+		row1 = _mm_shuffle_ps (row1, tmp1, 0xDD);
+		tmp1 = _mm_loadh_pi (_mm_loadl_pi (_mm_setzero_ps (), (const __m64 *)(src + 2)), (const __m64 *)(src + 6));
+		row3 = _mm_loadh_pi (_mm_loadl_pi (_mm_setzero_ps (), (const __m64 *)(src + 10)), (const __m64 *)(src + 14));
+		row2 = _mm_shuffle_ps (tmp1, row3, 0x88);
+		row3 = _mm_shuffle_ps (row3, tmp1, 0xDD);
+
+		tmp1 = _mm_mul_ps (row2, row3);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0xB1);
+		minor0 = _mm_mul_ps (row1, tmp1);
+		minor1 = _mm_mul_ps (row0, tmp1);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0x4E);
+		minor0 = _mm_sub_ps (_mm_mul_ps (row1, tmp1), minor0);
+		minor1 = _mm_sub_ps (_mm_mul_ps (row0, tmp1), minor1);
+		minor1 = _mm_shuffle_ps (minor1, minor1, 0x4E);
+
+		tmp1 = _mm_mul_ps (row1, row2);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0xB1);
+		minor0 = _mm_add_ps (_mm_mul_ps (row3, tmp1), minor0);
+		minor3 = _mm_mul_ps (row0, tmp1);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0x4E);
+		minor0 = _mm_sub_ps (minor0, _mm_mul_ps (row3, tmp1));
+		minor3 = _mm_sub_ps (_mm_mul_ps (row0, tmp1), minor3);
+		minor3 = _mm_shuffle_ps (minor3, minor3, 0x4E);
+
+		tmp1 = _mm_mul_ps (_mm_shuffle_ps (row1, row1, 0x4E), row3);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0xB1);
+		row2 = _mm_shuffle_ps (row2, row2, 0x4E);
+		minor0 = _mm_add_ps (_mm_mul_ps (row2, tmp1), minor0);
+		minor2 = _mm_mul_ps (row0, tmp1);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0x4E);
+		minor0 = _mm_sub_ps (minor0, _mm_mul_ps (row2, tmp1));
+		minor2 = _mm_sub_ps (_mm_mul_ps (row0, tmp1), minor2);
+		minor2 = _mm_shuffle_ps (minor2, minor2, 0x4E);
+
+		tmp1 = _mm_mul_ps (row0, row1);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0xB1);
+		minor2 = _mm_add_ps (_mm_mul_ps (row3, tmp1), minor2);
+		minor3 = _mm_sub_ps (_mm_mul_ps (row2, tmp1), minor3);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0x4E);
+		minor2 = _mm_sub_ps (_mm_mul_ps (row3, tmp1), minor2);
+		minor3 = _mm_sub_ps (minor3, _mm_mul_ps (row2, tmp1));
+
+		tmp1 = _mm_mul_ps (row0, row3);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0xB1);
+		minor1 = _mm_sub_ps (minor1, _mm_mul_ps (row2, tmp1));
+		minor2 = _mm_add_ps (_mm_mul_ps (row1, tmp1), minor2);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0x4E);
+		minor1 = _mm_add_ps (_mm_mul_ps (row2, tmp1), minor1);
+		minor2 = _mm_sub_ps (minor2, _mm_mul_ps (row1, tmp1));
+
+		tmp1 = _mm_mul_ps (row0, row2);
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0xB1);
+		minor1 = _mm_add_ps (_mm_mul_ps (row3, tmp1), minor1);
+		minor3 = _mm_sub_ps (minor3, _mm_mul_ps (row1, tmp1));
+		tmp1 = _mm_shuffle_ps (tmp1, tmp1, 0x4E);
+		minor1 = _mm_sub_ps (minor1, _mm_mul_ps (row3, tmp1));
+		minor3 = _mm_add_ps (_mm_mul_ps (row1, tmp1), minor3);
+
+		det = _mm_mul_ps (row0, minor0);
+		det = _mm_add_ps (_mm_shuffle_ps (det, det, 0x4E), det);
+		det = _mm_add_ss (_mm_shuffle_ps (det, det, 0xB1), det);
+		det = _mm_div_ss (_mm_set_ss (1.0f), det); // a real division, rcp is only good for 12 bits
+		det = _mm_shuffle_ps (det, det, 0x00);
+		_mm_storeu_ps (m[0], _mm_mul_ps (det, minor0));
+		_mm_storeu_ps (m[1], _mm_mul_ps (det, minor1));
+		_mm_storeu_ps (m[2], _mm_mul_ps (det, minor2));
+		_mm_storeu_ps (m[3], _mm_mul_ps (det, minor3));
+	} // the sse version of the scalar code below
+#else
 	Matrix4 operator* (const Matrix4 &rhs) const {
 		Matrix4 t;
 		for (int i = 0; i < 4; i++) { for (int j = 0; j < 4; j++) { t.m[i][j] = m[i][0] * rhs.m[0][j] + m[i][1] * rhs.m[1][j] + m[i][2] * rhs.m[2][j] + m[i][3] * rhs.m[3][j]; } }
@@ -99,6 +261,7 @@ struct Matrix4 {
 		m[2][0] *= idet; m[2][1] *= idet; m[2][2] *= idet; m[2][3] *= idet;
 		m[3][0] *= idet; m[3][1] *= idet; m[3][2] *= idet; m[3][3] *= idet;
 	} // copy from somewhere, no idea what it is.
+#endif
 
 	Matrix4 InvertTranspose () const {
 		Matrix4 t, o = *this;
@@ -110,15 +273,43 @@ struct Matrix4 {
 	} // (M-1)T
 }; // our matrix is in row-major order.
 
+#if defined(COBRA_SSE2)
+Vector4 TransformHomogeneous (const Vector4 &b, const Matrix4 &mat) {
+	return Vector4::Store (_mm_add_ps (mat.Combine (_mm_set1_ps (b.x), _mm_set1_ps (b.y), _mm_set1_ps (b.z)), mat.Row (3)));
+} // same as TransformPoint, without the perspective divide. clip space needs this.
+
+Vector4 TransformPoint (const Vector4 &b, const Matrix4 &mat) {
+	__m128 v = _mm_add_ps (mat.Combine (_mm_set1_ps (b.x), _mm_set1_ps (b.y), _mm_set1_ps (b.z)), mat.Row (3));
+	__m128 w = _mm_shuffle_ps (v, v, 0xff), invW = _mm_div_ps (_mm_set1_ps (1.0f), w);
+	__m128 xyz = _mm_mul_ps (v, invW);
+	return Vector4::Store (_mm_shuffle_ps (xyz, _mm_unpackhi_ps (xyz, w), 0x44)); // x, y, z divided, w kept
+} // using matrix to transform a point.
+
+Vector4 TransformDir (const Vector4 &b, const Matrix4 &mat) {
+	Vector4 v = Vector4::Store (mat.Combine (_mm_set1_ps (b.x), _mm_set1_ps (b.y), _mm_set1_ps (b.z)));
+	v.w = 0;
+	return v;
+} // using matrix to transform a direction.
+#else
 Vector4 TransformPoint (const Vector4 &b, const Matrix4 &mat) {
 	Vector4 v;
 	v.w = b.x * mat.m[0][3] + b.y * mat.m[1][3] + b.z * mat.m[2][3] + mat.m[3][3];
-	v.x = (b.x * mat.m[0][0] + b.y * mat.m[1][0] + b.z * mat.m[2][0] + mat.m[3][0]) / v.w;
-	v.y = (b.x * mat.m[0][1] + b.y * mat.m[1][1] + b.z * mat.m[2][1] + mat.m[3][1]) / v.w;
-	v.z = (b.x * mat.m[0][2] + b.y * mat.m[1][2] + b.z * mat.m[2][2] + mat.m[3][2]) / v.w;
+	float invW = 1.0f / v.w;
+	v.x = (b.x * mat.m[0][0] + b.y * mat.m[1][0] + b.z * mat.m[2][0] + mat.m[3][0]) * invW;
+	v.y = (b.x * mat.m[0][1] + b.y * mat.m[1][1] + b.z * mat.m[2][1] + mat.m[3][1]) * invW;
+	v.z = (b.x * mat.m[0][2] + b.y * mat.m[1][2] + b.z * mat.m[2][2] + mat.m[3][2]) * invW;
 	return v;
 } // using matrix to transform a point.
 
+Vector4 TransformHomogeneous (const Vector4 &b, const Matrix4 &mat) {
+	Vector4 v;
+	v.w = b.x * mat.m[0][3] + b.y * mat.m[1][3] + b.z * mat.m[2][3] + mat.m[3][3];
+	v.x = b.x * mat.m[0][0] + b.y * mat.m[1][0] + b.z * mat.m[2][0] + mat.m[3][0];
+	v.y = b.x * mat.m[0][1] + b.y * mat.m[1][1] + b.z * mat.m[2][1] + mat.m[3][1];
+	v.z = b.x * mat.m[0][2] + b.y * mat.m[1][2] + b.z * mat.m[2][2] + mat.m[3][2];
+	return v;
+} // same as TransformPoint, without the perspective divide. clip space needs this.
+
 Vector4 TransformDir (const Vector4 &b, const Matrix4 &mat) {
 	Vector4 v = { 0 };
 	v.x = b.x * mat.m[0][0] + b.y * mat.m[1][0] + b.z * mat.m[2][0];
@@ -126,6 +317,32 @@ Vector4 TransformDir (const Vector4 &b, const Matrix4 &mat) {
 	v.z = b.x * mat.m[0][2] + b.y * mat.m[1][2] + b.z * mat.m[2][2];
 	return v;
 } // using matrix to transform a direction.
+#endif
+
+// batched versions of the three functions above, for the vertex stage. four vertices are transposed so that each
+// register holds one component of all four(soa), then every output component is one multiply-add chain.
+enum TransformKind { TRANSFORM_HOMOGENEOUS, TRANSFORM_POINT, TRANSFORM_DIR };
+template <int KIND> void TransformBatch (const Vector4 *in, int n, const Matrix4 &mat, Vector4 *out) {
+	int i = 0;
+#if defined(COBRA_SSE2)
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = in[i].Load (), y = in[i + 1].Load (), z = in[i + 2].Load (), w = in[i + 3].Load (), o[4];
+		_MM_TRANSPOSE4_PS (x, y, z, w); // the input w is ignored, points have w == 1 and directions w == 0
+		for (int j = 0; j < 4; j++) {
+			o[j] = _mm_add_ps (_mm_add_ps (_mm_mul_ps (x, _mm_set1_ps (mat.m[0][j])), _mm_mul_ps (y, _mm_set1_ps (mat.m[1][j]))), _mm_mul_ps (z, _mm_set1_ps (mat.m[2][j])));
+			if (KIND != TRANSFORM_DIR) o[j] = _mm_add_ps (o[j], _mm_set1_ps (mat.m[3][j]));
+		}
+		if (KIND == TRANSFORM_POINT) {
+			__m128 invW = _mm_div_ps (_mm_set1_ps (1.0f), o[3]);
+			o[0] = _mm_mul_ps (o[0], invW), o[1] = _mm_mul_ps (o[1], invW), o[2] = _mm_mul_ps (o[2], invW);
+		}
+		if (KIND == TRANSFORM_DIR) o[3] = _mm_setzero_ps ();
+		_MM_TRANSPOSE4_PS (o[0], o[1], o[2], o[3]);
+		for (int j = 0; j < 4; j++) _mm_storeu_ps (&out[i + j].x, o[j]);
+	}
+#endif
+	for (; i < n; i++) out[i] = KIND == TRANSFORM_POINT ? TransformPoint (in[i], mat) : KIND == TRANSFORM_DIR ? TransformDir (in[i], mat) : TransformHomogeneous (in[i], mat);
+} // out[i] = TransformHomogeneous/TransformPoint/TransformDir (in[i], mat), in and out must not overlap
 
 Matrix4 CreateProjectionMatrix (float hfov, float ratio, float n, float f) {
 	float r = n * tan (hfov * 0.5f), l = -r, b = -r / ratio, t = r / ratio;
@@ -148,299 +365,2095 @@ Matrix4 CreateViewMatrix (const Vector4 &look, const Vector4 &at, const Vector4
 	return mat;
 } // view matrix, camera matrix, whatever you call it.
 
-Matrix4 CreateModelMatrix (const Vector4 &translate) {
+Matrix4 CreateModelMatrix (const Vector4 &translate, const Vector4 &rotate = { 0 }, const Vector4 &scale = { 1, 1, 1 }) {
+	float cx = std::cos (rotate.x), sx = std::sin (rotate.x), cy = std::cos (rotate.y), sy = std::sin (rotate.y), cz = std::cos (rotate.z), sz = std::sin (rotate.z);
 	Matrix4 mat;
+	mat.m[0][0] = (cy * cz) * scale.x; mat.m[0][1] = (cy * sz) * scale.x; mat.m[0][2] = -sy * scale.x;
+	mat.m[1][0] = (sx * sy * cz - cx * sz) * scale.y; mat.m[1][1] = (sx * sy * sz + cx * cz) * scale.y; mat.m[1][2] = (sx * cy) * scale.y;
+	mat.m[2][0] = (cx * sy * cz + sx * sz) * scale.z; mat.m[2][1] = (cx * sy * sz - sx * cz) * scale.z; mat.m[2][2] = (cx * cy) * scale.z;
 	mat.m[3][0] = translate.x; mat.m[3][1] = translate.y; mat.m[3][2] = translate.z;
 	return mat;
-} // model(world) matrix, now we only support translate. rotate/scale is NOT supported.
+} // model(world) matrix, "pos * scale * rotate(x, then y, then z, in radians) * translate".
+
+Matrix4 CreateNormalMatrix (const Matrix4 &m) {
+	Matrix4 mat;
+	float c[3][3] = {
+		{ m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1], m.m[1][2] * m.m[2][0] - m.m[1][0] * m.m[2][2], m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0] },
+		{ m.m[0][2] * m.m[2][1] - m.m[0][1] * m.m[2][2], m.m[0][0] * m.m[2][2] - m.m[0][2] * m.m[2][0], m.m[0][1] * m.m[2][0] - m.m[0][0] * m.m[2][1] },
+		{ m.m[0][1] * m.m[1][2] - m.m[0][2] * m.m[1][1], m.m[0][2] * m.m[1][0] - m.m[0][0] * m.m[1][2], m.m[0][0] * m.m[1][1] - m.m[0][1] * m.m[1][0] } };
+	float idet = 1.0f / (m.m[0][0] * c[0][0] + m.m[0][1] * c[0][1] + m.m[0][2] * c[0][2]);
+	for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) mat.m[i][j] = c[i][j] * idet;
+	return mat;
+} // (M-1)T of the upper 3x3 only, all TransformDir() needs. cofactors instead of the full 4x4 Invert()
 
 struct Vertex { Vector4 pos, uv, normal, viewPos, color; };
-struct Index { int pos[3], uv[3], normal[3]; };
-struct Texture { int width, height; float smax, tmax; std::vector<Vector4> data; };
-struct Material { float ka, kd, ks; Texture texture; };
-struct Light { Vector4 pos, viewPos, ambientColor, diffuseColor, specularColor; };
-
-void SaveBmp (std::vector<Vector4> &frameBuffer, int width, int height, std::string file) {
-#define INT2CHAR_BIT(num, bit) (unsigned char)(((num) >> (bit)) & 0xff)
-#define INT2CHAR(num) INT2CHAR_BIT((num),0), INT2CHAR_BIT((num),8), INT2CHAR_BIT((num),16), INT2CHAR_BIT((num),24)
-	unsigned char buf[54] = { 'B', 'M', INT2CHAR (54 + width*height * 32), INT2CHAR (0), INT2CHAR (54), INT2CHAR (40), INT2CHAR (width), INT2CHAR (height), 1, 0, 32, 0 };
+struct Index { int pos, uv, normal; }; // one face corner of an obj file, 0 means missing
+struct Texture {
+	struct Level { int width, height, tileCols; std::vector<uint32_t> data; }; // rgba8 texels, stored in 4x4 tiles
+	std::vector<Level> levels; // mip chain, levels[0] is the full size image
+}; // 4x4 texels of 4 bytes are exactly one cache line, so a bilinear footprint rarely touches more than one line
+enum TextureFilter { FILTER_TRILINEAR, FILTER_BILINEAR, FILTER_NEAREST }; // bilinear and nearest sample the top level only
+struct Material { float ka, kd, ks; std::shared_ptr<const Texture> texture; TextureFilter filter; }; // no texture means a plain default color, kd == ks == 0 means unlit
+struct Light { Vector4 pos, ambientColor, diffuseColor, specularColor; };
+struct PointLight { Vector4 pos, color; float radius; }; // local light in world space, no effect beyond radius
+struct Rect { int x0, y0, x1, y1; }; // inclusive pixel range
+
+struct ThreadPool {
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable startCond, doneCond;
+	const std::function<void (int, int)> *job = nullptr;
+	std::atomic<int> next { 0 };
+	int count = 0, busy = 0, generation = 0;
+	bool quit = false;
+
+	explicit ThreadPool (int threads = 1) { Resize (threads); }
+	~ThreadPool () { Resize (1); }
+	ThreadPool (const ThreadPool &) = delete;
+	ThreadPool &operator= (const ThreadPool &) = delete;
+
+	int Size () const { return (int)workers.size () + 1; } // the calling thread is one of the workers
+
+	void Resize (int threads) {
+		{ std::lock_guard<std::mutex> lock (mutex); quit = true; }
+		startCond.notify_all ();
+		for (auto &t : workers) t.join ();
+		workers.clear ();
+		quit = false;
+		for (int i = 1; i < threads; i++) workers.emplace_back (&ThreadPool::WorkerLoop, this, i, generation);
+	} // must not be called while a ParallelFor is running
+
+	void ParallelFor (int n, const std::function<void (int, int)> &func) {
+		if (workers.empty () || n <= 1) {
+			for (int i = 0; i < n; i++) func (i, 0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			job = &func; count = n; next = 0; busy = (int)workers.size (); generation++;
+		}
+		startCond.notify_all ();
+		RunJob (func, 0);
+		std::unique_lock<std::mutex> lock (mutex);
+		doneCond.wait (lock, [this] { return busy == 0; });
+		job = nullptr;
+	} // call func (index, thread) for every index in [0, n), returns when all of them are done
+
+	void RunJob (const std::function<void (int, int)> &func, int thread) {
+		for (int i = next++; i < count; i = next++) func (i, thread);
+	}
+
+	void WorkerLoop (int thread, int seen) {
+		for (;;) {
+			const std::function<void (int, int)> *func;
+			{
+				std::unique_lock<std::mutex> lock (mutex);
+				startCond.wait (lock, [&] { return quit || generation != seen; });
+				if (quit) return;
+				seen = generation, func = job;
+			}
+			RunJob (*func, thread);
+			{ std::lock_guard<std::mutex> lock (mutex); busy--; }
+			doneCond.notify_one ();
+		}
+	}
+}; // workers pull indices from a shared counter, so uneven jobs balance themselves.
+
+// render target formats. color is written once per pixel and never read back while rendering,
+// so a compact format mostly saves memory bandwidth. depth is compared as an unsigned integer.
+enum ColorFormat { COLOR_RGBA8, COLOR_RGBA16F, COLOR_RGBA32F };
+enum DepthFormat { DEPTH_16, DEPTH_24, DEPTH_32F };
+
+static inline uint16_t FloatToHalf (float f) {
+	uint32_t x;
+	memcpy (&x, &f, 4);
+	uint32_t sign = (x >> 16) & 0x8000, m = x & 0x7fffff;
+	int e = (int)((x >> 23) & 0xff) - 127 + 15;
+	if (e == 128 + 15) return (uint16_t)(sign | 0x7c00 | (m ? 0x200 : 0)); // inf or nan
+	if (e >= 31) return (uint16_t)(sign | 0x7c00); // too large, becomes inf
+	if (e <= 0) {
+		if (e < -10) return (uint16_t)sign; // too small even for a denormal
+		m |= 0x800000;
+		int shift = 14 - e;
+		uint32_t h = m >> shift, rest = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+		return (uint16_t)(sign | (h + (rest > half || (rest == half && (h & 1)))));
+	}
+	uint32_t h = (uint32_t)e << 10 | m >> 13, rest = m & 0x1fff;
+	return (uint16_t)(sign | (h + (rest > 0x1000 || (rest == 0x1000 && (h & 1))))); // a carry into the exponent is still correct
+} // round to nearest even
+
+static inline float HalfToFloat (uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+	if (e == 31) x = sign | 0x7f800000 | m << 13;
+	else if (e) x = sign | (e + 112) << 23 | m << 13;
+	else return (sign ? -1.0f : 1.0f) * m * (1.0f / 16777216.0f); // zero or denormal
+	float f;
+	memcpy (&f, &x, 4);
+	return f;
+}
+
+static inline uint32_t Unorm8 (float c) { return (uint32_t)(std::min (std::max (c, 0.0f), 1.0f) * 255); } // truncates, like the old bmp writer did
+
+struct ColorBuffer {
+	int width, height;
+	ColorFormat format;
+	std::vector<unsigned char> data;
+
+	ColorBuffer (int w, int h, ColorFormat f, const Vector4 &clear) : width (w), height (h), format (f), data ((size_t)w * h * PixelSize (f)) { Clear (clear); }
+
+	static int PixelSize (ColorFormat f) { return f == COLOR_RGBA8 ? 4 : f == COLOR_RGBA16F ? 8 : 16; }
+
+	void Store (int i, const Vector4 &c) {
+		unsigned char *p = &data[(size_t)i * PixelSize (format)];
+		if (format == COLOR_RGBA8) {
+			uint32_t t = Unorm8 (c.x) | Unorm8 (c.y) << 8 | Unorm8 (c.z) << 16 | Unorm8 (c.w) << 24;
+			memcpy (p, &t, 4);
+		} else if (format == COLOR_RGBA16F) {
+			uint16_t t[4] = { FloatToHalf (c.x), FloatToHalf (c.y), FloatToHalf (c.z), FloatToHalf (c.w) };
+			memcpy (p, t, 8);
+		} else memcpy (p, &c, 16);
+	} // rgba8 keeps r in the low byte, same as textures
+
+	Vector4 Load (int i) const {
+		const unsigned char *p = &data[(size_t)i * PixelSize (format)];
+		if (format == COLOR_RGBA8) return{ p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f, p[3] / 255.0f };
+		Vector4 c;
+		if (format == COLOR_RGBA16F) {
+			uint16_t t[4];
+			memcpy (t, p, 8);
+			c = { HalfToFloat (t[0]), HalfToFloat (t[1]), HalfToFloat (t[2]), HalfToFloat (t[3]) };
+		} else memcpy (&c, p, 16);
+		return c;
+	}
+
+	void Clear (const Vector4 &c) {
+		if (data.empty ()) return;
+		Store (0, c);
+		for (size_t i = PixelSize (format); i < data.size (); i += PixelSize (format)) memcpy (&data[i], &data[0], PixelSize (format));
+	}
+};
+
+struct DepthBuffer {
+	int width, height;
+	DepthFormat format;
+	float invNear, depthScale;
+	std::vector<unsigned char> data;
+
+	DepthBuffer (int w, int h, DepthFormat f) : width (w), height (h), format (f), data ((size_t)w * h * PixelSize (f)) {
+		SetRange (0.1f, 1000.0f);
+		Clear ();
+	}
+
+	static int PixelSize (DepthFormat f) { return f == DEPTH_16 ? 2 : f == DEPTH_24 ? 3 : 4; } // 24 bit depth is packed, no padding byte
+
+	void SetRange (float n, float f) { invNear = 1.0f / n, depthScale = 1.0f / (1.0f / n - 1.0f / f); }
+
+	uint32_t Encode (float z) const {
+		if (format == DEPTH_32F) {
+			uint32_t d;
+			memcpy (&d, &z, 4);
+			return d;
+		} // z is never negative, and non-negative floats sort like their bit patterns
+		uint32_t max = format == DEPTH_16 ? 0xffff : 0xffffff;
+		float d = std::min (std::max ((invNear - 1.0f / z) * depthScale, 0.0f), 1.0f);
+		return std::min (max, (uint32_t)(d * max + 0.5f));
+	} // z is view space depth, unorm formats store (1/n - 1/z) / (1/n - 1/f) so precision goes where perspective needs it
+
+	uint32_t Load (int i) const {
+		const unsigned char *p = &data[(size_t)i * PixelSize (format)];
+		if (format == DEPTH_16) return p[0] | p[1] << 8;
+		if (format == DEPTH_24) return p[0] | p[1] << 8 | p[2] << 16;
+		return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+	}
+
+	void Store (int i, uint32_t d) {
+		unsigned char *p = &data[(size_t)i * PixelSize (format)];
+		p[0] = (unsigned char)d, p[1] = (unsigned char)(d >> 8);
+		if (format != DEPTH_16) p[2] = (unsigned char)(d >> 16);
+		if (format == DEPTH_32F) p[3] = (unsigned char)(d >> 24);
+	} // byte stores, neighbour pixels may belong to another thread's tile
+
+	void Clear () {
+		if (format != DEPTH_32F) {
+			std::fill (data.begin (), data.end (), 0xff);
+			return;
+		} // the farthest unorm depth is all ones
+		uint32_t d = Encode (std::numeric_limits<float>::max ());
+		for (int i = 0; i < width * height; i++) Store (i, d);
+	}
+};
+
+// image output. rows are packed straight into the final file image, which is then written with a single call.
+void PackRow (const ColorBuffer &image, int y, bool bgra, unsigned char *dst) {
+	int n = image.width, step = bgra ? 4 : 3;
+	if (image.format == COLOR_RGBA8) {
+		const unsigned char *src = &image.data[(size_t)y * n * 4];
+		if (bgra) {
+			for (int i = 0; i < n; i++, src += 4, dst += 4) {
+				uint32_t t;
+				memcpy (&t, src, 4);
+				t = (t & 0xff00ff00) | (t >> 16 & 0xff) | (t & 0xff) << 16;
+				memcpy (dst, &t, 4);
+			}
+		}
+		else for (int i = 0; i < n; i++, src += 4, dst += 3) dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
+		return;
+	} // the common case is a plain swizzle
+	for (int i = 0; i < n; i++, dst += step) {
+		Vector4 c = image.Load (y * n + i);
+		dst[0] = (unsigned char)Unorm8 (bgra ? c.z : c.x), dst[1] = (unsigned char)Unorm8 (c.y), dst[2] = (unsigned char)Unorm8 (bgra ? c.x : c.z);
+		if (bgra) dst[3] = (unsigned char)Unorm8 (c.w);
+	}
+} // convert one row to 8 bit rgb or bgra
+
+static uint32_t Crc32 (const unsigned char *p, size_t n) {
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> t (4 * 256);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		for (int s = 1; s < 4; s++)
+			for (int i = 0; i < 256; i++) t[s * 256 + i] = (t[(s - 1) * 256 + i] >> 8) ^ t[t[(s - 1) * 256 + i] & 0xff];
+		return t;
+	} ();
+	uint32_t crc = 0xffffffff;
+	for (; n >= 4; n -= 4, p += 4) {
+		crc ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = table[768 + (crc & 0xff)] ^ table[512 + ((crc >> 8) & 0xff)] ^ table[256 + ((crc >> 16) & 0xff)] ^ table[crc >> 24];
+	}
+	while (n--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+} // slicing by 4, four independent table lookups per step
+
+static uint32_t Adler32 (const unsigned char *p, size_t n, uint32_t adler) {
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+	while (n) {
+		size_t k = std::min (n, (size_t)5552);
+		n -= k;
+		while (k--) a += *p++, b += a;
+		a %= 65521, b %= 65521;
+	}
+	return b << 16 | a;
+} // 5552 bytes is the longest run that can not overflow b before the modulo
+
+bool SaveImage (const ColorBuffer &image, std::string file) {
+	int w = image.width, h = image.height;
+	std::string ext = file.size () >= 4 ? file.substr (file.size () - 4) : "";
+	for (auto &c : ext) c = (char)tolower (c);
+	std::vector<unsigned char> out;
+	auto Put32 = [] (unsigned char *p, uint32_t n, bool bigEndian) {
+		for (int i = 0; i < 4; i++) p[i] = (unsigned char)(n >> (bigEndian ? 24 - i * 8 : i * 8));
+	};
+
+	if (ext == ".ppm") {
+		std::string header = "P6\n" + std::to_string (w) + " " + std::to_string (h) + "\n255\n";
+		out.resize (header.size () + (size_t)w * h * 3);
+		memcpy (out.data (), header.data (), header.size ());
+		for (int y = 0; y < h; y++) PackRow (image, h - 1 - y, false, &out[header.size () + (size_t)y * w * 3]);
+	} else if (ext == ".png") {
+		// no compression at all, the deflate stream is made of stored blocks. most of the cost is the two checksums.
+		size_t rowSize = (size_t)w * 3 + 1, raw = rowSize * h, blocks = std::max ((size_t)1, (raw + 65534) / 65535);
+		size_t idat = 2 + raw + blocks * 5 + 4;
+		out.resize (8 + 25 + 12 + idat + 12);
+		unsigned char *p = out.data ();
+		const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		memcpy (p, signature, 8);
+		p += 8;
+		auto Chunk = [&] (const char *type, size_t size, std::function<void (unsigned char *)> fill) {
+			Put32 (p, (uint32_t)size, true);
+			memcpy (p + 4, type, 4);
+			fill (p + 8);
+			Put32 (p + 8 + size, Crc32 (p + 4, size + 4), true);
+			p += size + 12;
+		};
+		Chunk ("IHDR", 13, [&] (unsigned char *d) {
+			Put32 (d, w, true), Put32 (d + 4, h, true);
+			d[8] = 8, d[9] = 2, d[10] = d[11] = d[12] = 0; // 8 bit rgb, no interlace
+		}); // the frame buffer alpha is not meaningful, so we do not store it
+		Chunk ("IDAT", idat, [&] (unsigned char *d) {
+			std::vector<unsigned char> row (rowSize);
+			uint32_t adler = 1;
+			size_t left = 0, done = 0;
+			*d++ = 0x78, *d++ = 0x01;
+			for (int y = 0; y < h; y++) {
+				row[0] = 0; // filter type none
+				PackRow (image, h - 1 - y, false, &row[1]);
+				adler = Adler32 (row.data (), rowSize, adler);
+				for (size_t i = 0; i < rowSize;) {
+					if (!left) {
+						left = std::min ((size_t)65535, raw - done);
+						d[0] = done + left == raw, d[1] = (unsigned char)left, d[2] = (unsigned char)(left >> 8), d[3] = (unsigned char)~left, d[4] = (unsigned char)(~left >> 8);
+						d += 5;
+					} // stored block header: final flag, length and its complement
+					size_t n = std::min (left, rowSize - i);
+					memcpy (d, &row[i], n);
+					d += n, i += n, left -= n, done += n;
+				}
+			}
+			if (!raw) *d++ = 1, *d++ = 0, *d++ = 0, *d++ = 0xff, *d++ = 0xff; // an empty image still needs a final block
+			Put32 (d, adler, true);
+		});
+		Chunk ("IEND", 0, [] (unsigned char *) {});
+	} else {
+		const uint32_t size = 54 + w * h * 4;
+		out.resize (size);
+		unsigned char header[54] = { 'B', 'M' };
+		Put32 (header + 2, size, false), Put32 (header + 10, 54, false), Put32 (header + 14, 40, false);
+		Put32 (header + 18, w, false), Put32 (header + 22, h, false);
+		header[26] = 1, header[28] = 32;
+		memcpy (out.data (), header, 54);
+		for (int y = 0; y < h; y++) PackRow (image, y, true, &out[54 + (size_t)y * w * 4]);
+	} // bmp's color is bgra order, rows go bottom up just like our frame buffer
+
 	std::ofstream ofs (file, std::ios_base::out | std::ios_base::binary);
-	ofs.write ((char *)buf, sizeof (buf));
-	for (auto &color : frameBuffer) {
-		buf[0] = (unsigned char)std::min (255, (int)(color.z * 255));
-		buf[1] = (unsigned char)std::min (255, (int)(color.y * 255));
-		buf[2] = (unsigned char)std::min (255, (int)(color.x * 255));
-		buf[3] = (unsigned char)std::min (255, (int)(color.w * 255));
-		ofs.write ((char *)buf, 4);
+	ofs.write ((const char *)out.data (), out.size ());
+	return (bool)ofs;
+} // picks ppm, png or bmp from the file extension
+
+void CreateTexture (Texture &texture, int width, int height, const uint32_t *texels) {
+	auto Store = [] (Texture::Level &level, int x, int y, uint32_t texel) {
+		level.data[((y >> 2) * level.tileCols + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)] = texel;
+	};
+	auto Load = [] (const Texture::Level &level, int x, int y) {
+		return level.data[((y >> 2) * level.tileCols + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)];
+	};
+	texture.levels.clear ();
+	for (int w = width, h = height; ; w = std::max (1, w / 2), h = std::max (1, h / 2)) {
+		texture.levels.push_back ({ w, h, (w + 3) / 4, std::vector<uint32_t> ((size_t)((w + 3) / 4) * ((h + 3) / 4) * 16) });
+		Texture::Level &level = texture.levels.back ();
+		if (texture.levels.size () == 1) {
+			for (int y = 0; y < h; y++) for (int x = 0; x < w; x++) Store (level, x, y, texels[x + y * w]);
+		} else {
+			const Texture::Level &src = texture.levels[texture.levels.size () - 2];
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					int sx0 = std::min (x * 2, src.width - 1), sx1 = std::min (x * 2 + 1, src.width - 1);
+					int sy0 = std::min (y * 2, src.height - 1), sy1 = std::min (y * 2 + 1, src.height - 1);
+					uint32_t t[4] = { Load (src, sx0, sy0), Load (src, sx1, sy0), Load (src, sx0, sy1), Load (src, sx1, sy1) }, texel = 0;
+					for (int c = 0; c < 32; c += 8)
+						texel |= ((((t[0] >> c) & 0xff) + ((t[1] >> c) & 0xff) + ((t[2] >> c) & 0xff) + ((t[3] >> c) & 0xff) + 2) / 4) << c;
+					Store (level, x, y, texel);
+				}
+			} // 2x2 box filter
+		}
+		if (w == 1 && h == 1) break;
 	}
-} // bmp's color is bgra order
+} // texels are rgba8 in row-major order, r in the lowest byte
 
 bool LoadBmp (Texture &texture, std::string file) {
 	std::ifstream is (file, std::ios_base::binary);
 	if (!is) return false;
 	unsigned char buf[54];
 	is.read ((char *)buf, sizeof (buf));
-	// in bmp header, height could be negtive
-	texture.width = *(int *)&buf[18], texture.height = abs (*(int *)&buf[22]);
-	// smax/tmax is use for texture filtering
-	texture.smax = texture.width - 1.5f, texture.tmax = texture.height - 1.5f;
-	int bytes = buf[28] / 8, count = texture.width * texture.height * bytes;
-	unsigned char *tmp = new unsigned char[count];
-	is.read ((char *)tmp, count);
-	texture.data.resize (texture.width * texture.height);
-	count = 0;
-	for (auto &color : texture.data) {
-		color = { tmp[count + 2] / 255.0f, tmp[count + 1] / 255.0f, tmp[count + 0] / 255.0f, 0.0f };
-		count += bytes;
-	}
-	delete[]tmp;
+	// in bmp header, height could be negtive, which means the rows are stored top-down
+	int width = *(int *)&buf[18], height = abs (*(int *)&buf[22]), bytes = buf[28] / 8, stride = (width * bytes + 3) & ~3;
+	if (!is || width <= 0 || height <= 0 || bytes < 3) return false;
+	std::vector<unsigned char> tmp ((size_t)stride * height);
+	is.seekg (*(int *)&buf[10]);
+	is.read ((char *)tmp.data (), tmp.size ());
+	std::vector<uint32_t> texels ((size_t)width * height);
+	for (int y = 0; y < height; y++) {
+		const unsigned char *row = &tmp[(size_t)stride * (*(int *)&buf[22] < 0 ? height - 1 - y : y)];
+		for (int x = 0; x < width; x++, row += bytes)
+			texels[x + y * width] = row[2] | (row[1] << 8) | (row[0] << 16);
+	} // bgr to rgba8, alpha is left 0
+	CreateTexture (texture, width, height, texels.data ());
 	return true;
 } // load bmp into texture
 
-struct Model {
-	Material material;
-	std::vector<Vector4> posBuffer, normalBuffer, uvBuffer;
-	std::vector<Index> indexBuffer;
-	Matrix4 worldMat;
+struct MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+#endif
 
-	Model (std::string name, const Vector4 &pos, Material m) : material (m), posBuffer (1, { 0 }), normalBuffer (1, { 0 }), uvBuffer (1, { 0 }) {
-		worldMat = CreateModelMatrix (pos);
-		LoadObj (name + ".obj");
-		if (uvBuffer.size () > 1) // load texture only if the model has uv data.
-			LoadBmp (material.texture, name + ".bmp");
-	}
-
-	void LoadObj (std::string str) {
-		float x, y, z;
-		char dummy;
-		std::ifstream is (str);
-		while (std::getline (is, str)) {
-			if (str.length () < 2) continue;
-			std::istringstream iss (str);
-			std::string token;
-			if (str[1] == 't' && str[0] == 'v') { // load uv. "vt -0.05 0.0972793"
-				iss >> token >> x >> y;
-				uvBuffer.push_back ({ x, y });
-			} else if (str[1] == 'n' && str[0] == 'v') { // load normal. "vn -0.981591 -0.162468 0.100411"
-				iss >> token >> x >> y >> z;
-				normalBuffer.push_back ({ x, y, z });
-			} else if (str[0] == 'v') { // load postion. "v -0.983024 -0.156077 0.0964607"
-				iss >> token >> x >> y >> z;
-				posBuffer.push_back ({ x, y, z });
-			} else if (str[0] == 'f') { // load index. keep in mind that uv/normal index are optional.
-				Index index = { { 0 } };
-				if (str.find ("//") != std::string::npos) { // pos//normal, no uv. "f 181//176 182//182 209//208"
-					iss >> token >> index.pos[0] >> dummy >> dummy >> index.normal[0] >>
-						index.pos[1] >> dummy >> dummy >> index.normal[1] >>
-						index.pos[2] >> dummy >> dummy >> index.normal[2];
-				} else {
-					size_t count = 0, pos = str.find ('/');
-					while (pos != std::string::npos) { count++; pos = str.find ('/', pos + 1); }
-					if (count == 6) { // "f 181/292/176 182/250/182 209/210/208"
-						iss >> token >> index.pos[0] >> dummy >> index.uv[0] >> dummy >> index.normal[0] >>
-							index.pos[1] >> dummy >> index.uv[1] >> dummy >> index.normal[1] >>
-							index.pos[2] >> dummy >> index.uv[2] >> dummy >> index.normal[2];
-					} else if (count == 3) { // pos/uv, no normal. "f 181/176 182/182 209/208"
-						iss >> token >> index.pos[0] >> dummy >> index.uv[0] >> index.pos[1] >> dummy >> index.uv[1] >> index.pos[2] >> dummy >> index.uv[2];
-					}
+	explicit MappedFile (const std::string &path) {
+#ifdef _WIN32
+		file = CreateFileA (path.c_str (), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		LARGE_INTEGER len;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx (file, &len) || len.QuadPart == 0) return;
+		mapping = CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping && (data = (const char *)MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0)) != nullptr) size = (size_t)len.QuadPart;
+#else
+		int fd = open (path.c_str (), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat (fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap (nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				data = (const char *)p, size = (size_t)st.st_size;
+				madvise (p, size, MADV_SEQUENTIAL);
+			}
+		}
+		close (fd); // the mapping stays valid without the descriptor
+#endif
+	}
+
+	~MappedFile () {
+#ifdef _WIN32
+		if (data) UnmapViewOfFile (data);
+		if (mapping) CloseHandle (mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle (file);
+#else
+		if (data) munmap ((void *)data, size);
+#endif
+	}
+
+	MappedFile (const MappedFile &) = delete;
+	MappedFile &operator= (const MappedFile &) = delete;
+}; // read-only memory mapped file, data stays null if the file is missing or empty
+
+// a cluster of up to MESHLET_TRIANGLES neighbouring triangles. the normal cone holds every triangle normal, so the
+// whole cluster faces away from any eye that sees the bounding sphere from behind the cone, see Renderer::DrawMesh.
+struct Meshlet {
+	Vector4 center; // bounding sphere in model space
+	Vector4 cone; // xyz is the cone axis, w the cutoff. 2 means the normals spread too much to ever cull
+	float radius;
+	uint32_t firstIndex, triangleCount, reserved;
+};
+
+// binary mesh file(.cmesh), written by cobra_convert. the header is followed by the arrays in this order, every one
+// laid out exactly like in memory: pos, normal, uv(Vector4 * vertexCount), meshlets, indices(uint32_t * indexCount).
+struct MeshFileHeader {
+	char magic[4]; // "CMSH"
+	uint32_t version, vertexCount, indexCount, meshletCount, hasUv, reserved[2];
+	Vector4 boundsMin, boundsMax, center;
+	float radius, reserved2[3];
+};
+static_assert (sizeof (MeshFileHeader) == 96 && sizeof (Meshlet) == 48, "the file layout must not depend on the compiler");
+
+struct Mesh {
+	std::vector<Vector4> posBuffer, normalBuffer, uvBuffer; // welded, vertex i is (posBuffer[i], normalBuffer[i], uvBuffer[i])
+	std::vector<uint32_t> indexBuffer; // 3 indices per triangle
+	std::vector<Meshlet> meshlets; // optional, if present they cover indexBuffer in order
+	Vector4 boundsMin, boundsMax, center; // bounding box and bounding sphere in model space
+	float radius;
+	bool hasUv;
+
+	static const int MESHLET_TRIANGLES = 128, MESHLET_VERTICES = 128;
+	static const uint32_t FILE_VERSION = 1;
+
+	Mesh () : boundsMin (), boundsMax (), center (), radius (0), hasUv (false) {}
+
+	explicit Mesh (const std::string &file) : boundsMin (), boundsMax (), center (), radius (0), hasUv (false) {
+		if (file.size () > 6 && file.compare (file.size () - 6, 6, ".cmesh") == 0) LoadBinary (file); // comes with its bounds, empty if rejected
+		else {
+			hasUv = LoadObj (file);
+			ComputeBounds ();
+		}
+	}
+
+	bool LoadBinary (const std::string &file) {
+		MappedFile map (file);
+		MeshFileHeader header;
+		if (!map.data || map.size < sizeof (header)) return false;
+		memcpy (&header, map.data, sizeof (header));
+		size_t vertexBytes = (size_t)header.vertexCount * sizeof (Vector4), meshletBytes = (size_t)header.meshletCount * sizeof (Meshlet);
+		if (memcmp (header.magic, "CMSH", 4) || header.version != FILE_VERSION || header.indexCount % 3 ||
+			map.size != sizeof (header) + vertexBytes * 3 + meshletBytes + (size_t)header.indexCount * 4) return false;
+		posBuffer.resize (header.vertexCount), normalBuffer.resize (header.vertexCount), uvBuffer.resize (header.vertexCount);
+		meshlets.resize (header.meshletCount), indexBuffer.resize (header.indexCount);
+		const char *p = map.data + sizeof (header);
+		auto Copy = [&p] (void *to, size_t bytes) { if (bytes) memcpy (to, p, bytes); p += bytes; };
+		Copy (posBuffer.data (), vertexBytes), Copy (normalBuffer.data (), vertexBytes), Copy (uvBuffer.data (), vertexBytes);
+		Copy (meshlets.data (), meshletBytes), Copy (indexBuffer.data (), (size_t)header.indexCount * 4);
+		for (auto &m : meshlets) {
+			if (m.firstIndex % 3 || (uint64_t)m.firstIndex + (uint64_t)m.triangleCount * 3 > header.indexCount) {
+				posBuffer.clear (), normalBuffer.clear (), uvBuffer.clear (), meshlets.clear (), indexBuffer.clear ();
+				return false;
+			}
+		} // draws index the buffer through the meshlets, a range outside it is a broken file
+		for (uint32_t &i : indexBuffer) if (i >= header.vertexCount) i = 0; // a broken file must not crash the vertex stage
+		boundsMin = header.boundsMin, boundsMax = header.boundsMax, center = header.center, radius = header.radius;
+		hasUv = header.hasUv != 0;
+		return true;
+	} // no parsing at all, the arrays are copied straight out of the mapping. returns false and leaves the mesh empty if the file is rejected
+
+	bool SaveBinary (const std::string &file) const {
+		MeshFileHeader header = {};
+		memcpy (header.magic, "CMSH", 4);
+		header.version = FILE_VERSION, header.vertexCount = (uint32_t)posBuffer.size (), header.indexCount = (uint32_t)indexBuffer.size ();
+		header.meshletCount = (uint32_t)meshlets.size (), header.hasUv = hasUv;
+		header.boundsMin = boundsMin, header.boundsMax = boundsMax, header.center = center, header.radius = radius;
+		size_t vertexBytes = posBuffer.size () * sizeof (Vector4), meshletBytes = meshlets.size () * sizeof (Meshlet);
+		std::vector<char> image (sizeof (header) + vertexBytes * 3 + meshletBytes + indexBuffer.size () * 4);
+		char *p = image.data ();
+		auto Copy = [&p] (const void *from, size_t bytes) { if (bytes) memcpy (p, from, bytes); p += bytes; };
+		Copy (&header, sizeof (header));
+		Copy (posBuffer.data (), vertexBytes), Copy (normalBuffer.data (), vertexBytes), Copy (uvBuffer.data (), vertexBytes);
+		Copy (meshlets.data (), meshletBytes), Copy (indexBuffer.data (), indexBuffer.size () * 4);
+		FILE *f = fopen (file.c_str (), "wb");
+		if (!f) return false;
+		bool ok = fwrite (image.data (), 1, image.size (), f) == image.size ();
+		return fclose (f) == 0 && ok;
+	} // one write, like SaveImage ()
+
+	void BuildMeshlets () {
+		size_t triangleCount = indexBuffer.size () / 3, vertexCount = posBuffer.size ();
+		const uint32_t NONE = 0xffffffffu;
+
+		// the triangles around every vertex, in one flat array
+		std::vector<uint32_t> start (vertexCount + 1, 0), around (triangleCount * 3);
+		for (size_t i = 0; i < triangleCount * 3; i++) start[indexBuffer[i] + 1]++;
+		for (size_t v = 0; v < vertexCount; v++) start[v + 1] += start[v];
+		std::vector<uint32_t> fill (start.begin (), start.end () - 1);
+		for (size_t i = 0; i < triangleCount * 3; i++) around[fill[indexBuffer[i]]++] = (uint32_t)(i / 3);
+
+		// grow every meshlet from a seed triangle, always taking the neighbour that adds the fewest new vertices.
+		// that keeps meshlets round and flat, which gives small spheres and narrow normal cones.
+		std::vector<unsigned char> used (triangleCount, 0);
+		std::vector<uint32_t> owner (vertexCount, NONE), order, candidates;
+		order.reserve (triangleCount);
+		meshlets.clear ();
+		for (size_t seed = 0; seed < triangleCount; seed++) {
+			if (used[seed]) continue;
+			uint32_t id = (uint32_t)meshlets.size (), first = (uint32_t)order.size ();
+			int vertices = 0;
+			candidates.assign (1, (uint32_t)seed);
+			while (order.size () - first < (size_t)MESHLET_TRIANGLES) {
+				int best = -1, bestNew = 4;
+				for (size_t c = 0; c < candidates.size ();) {
+					uint32_t t = candidates[c];
+					if (used[t]) {
+						candidates[c] = candidates.back ();
+						candidates.pop_back ();
+						continue;
+					} // taken meanwhile, drop it
+					const uint32_t *tri = &indexBuffer[t * 3];
+					int added = (owner[tri[0]] != id) + (owner[tri[1]] != id) + (owner[tri[2]] != id);
+					if (added < bestNew) best = (int)c, bestNew = added;
+					if (added == 0) break; // cannot do better
+					c++;
+				}
+				if (best < 0 || vertices + bestNew > MESHLET_VERTICES) break;
+				uint32_t t = candidates[best];
+				used[t] = 1, vertices += bestNew;
+				order.push_back (t);
+				for (int k = 0; k < 3; k++) {
+					uint32_t v = indexBuffer[t * 3 + k];
+					if (owner[v] == id) continue;
+					owner[v] = id;
+					for (uint32_t i = start[v]; i < start[v + 1]; i++) if (!used[around[i]]) candidates.push_back (around[i]);
 				}
-				indexBuffer.push_back (index);
 			}
-		} // end parsing
-		for (auto &index : indexBuffer) {
-			for (int i = 0; i < 3; i++) {
-				if (index.pos[i] < 0) index.pos[i] += (int)posBuffer.size ();
-				if (index.uv[i] < 0) index.uv[i] += (int)uvBuffer.size ();
-				if (index.normal[i] < 0) index.normal[i] += (int)normalBuffer.size ();
-			} // deal with negative index
+			meshlets.push_back ({ {}, {}, 0, first * 3, (uint32_t)order.size () - first, 0 });
+		}
+
+		// indices in meshlet order, vertices in order of first use. the vertices of a meshlet end up next to each
+		// other, so the vertex stage can skip whole runs of vertices that only culled meshlets use.
+		std::vector<uint32_t> remap (vertexCount, NONE), indices (order.size () * 3);
+		std::vector<Vector4> pos, normal, uv;
+		pos.reserve (vertexCount), normal.reserve (vertexCount), uv.reserve (vertexCount);
+		for (size_t i = 0; i < order.size () * 3; i++) {
+			uint32_t v = indexBuffer[order[i / 3] * 3 + i % 3];
+			if (remap[v] == NONE) {
+				remap[v] = (uint32_t)pos.size ();
+				pos.push_back (posBuffer[v]), normal.push_back (normalBuffer[v]), uv.push_back (uvBuffer[v]);
+			}
+			indices[i] = remap[v];
+		}
+		posBuffer.swap (pos), normalBuffer.swap (normal), uvBuffer.swap (uv), indexBuffer.swap (indices);
+
+		for (auto &m : meshlets) {
+			const uint32_t *index = &indexBuffer[m.firstIndex];
+			Vector4 lo = posBuffer[index[0]], hi = lo, axis = { 0, 0, 0, 0 };
+			for (uint32_t i = 0; i < m.triangleCount * 3; i++) {
+				const Vector4 &p = posBuffer[index[i]];
+				lo = { std::min (lo.x, p.x), std::min (lo.y, p.y), std::min (lo.z, p.z), 1 }, hi = { std::max (hi.x, p.x), std::max (hi.y, p.y), std::max (hi.z, p.z), 1 };
+			}
+			m.center = (lo + hi) * 0.5f, m.radius = 0;
+			for (uint32_t i = 0; i < m.triangleCount * 3; i++) m.radius = std::max (m.radius, (posBuffer[index[i]] - m.center).Dot (posBuffer[index[i]] - m.center));
+			m.radius = std::sqrt (m.radius);
+
+			// the same triangle normal BackFaceCulling () uses, (p1 - p0) x (p2 - p0)
+			auto FaceNormal = [&] (uint32_t t) {
+				const Vector4 &p0 = posBuffer[index[t * 3]], &p1 = posBuffer[index[t * 3 + 1]], &p2 = posBuffer[index[t * 3 + 2]];
+				Vector4 n = (p1 - p0).Cross (p2 - p0);
+				float len = std::sqrt (n.Dot (n));
+				return len > 0 ? n * (1.0f / len) : n;
+			};
+			for (uint32_t t = 0; t < m.triangleCount; t++) axis = axis + FaceNormal (t);
+			float len = std::sqrt (axis.Dot (axis)), minDot = len > 0 ? 1.0f : -1.0f;
+			if (len > 0) axis = axis * (1.0f / len);
+			for (uint32_t t = 0; t < m.triangleCount; t++) {
+				Vector4 n = FaceNormal (t);
+				if (n.Dot (n) > 0) minDot = std::min (minDot, n.Dot (axis));
+			}
+			m.cone = { axis.x, axis.y, axis.z, minDot <= 0.0f ? 2.0f : std::sqrt (1.0f - minDot * minDot) }; // sin of the cone angle
+		}
+	} // split the mesh into meshlets, reorders indices and vertices, the triangles of a meshlet stay in their original winding
+
+	void ComputeBounds () {
+		boundsMin = boundsMax = center = { 0, 0, 0, 1 }, radius = 0;
+		if (posBuffer.empty ()) return;
+		boundsMin = boundsMax = posBuffer[0];
+		for (auto &p : posBuffer) {
+			boundsMin = { std::min (boundsMin.x, p.x), std::min (boundsMin.y, p.y), std::min (boundsMin.z, p.z), 1 };
+			boundsMax = { std::max (boundsMax.x, p.x), std::max (boundsMax.y, p.y), std::max (boundsMax.z, p.z), 1 };
+		}
+		center = (boundsMin + boundsMax) * 0.5f;
+		for (auto &p : posBuffer) radius = std::max (radius, (p - center).Dot (p - center));
+		radius = std::sqrt (radius);
+	} // sphere around the box center, not the tightest sphere but good enough for culling
+
+	bool LoadObj (const std::string &file) {
+		MappedFile map (file);
+		if (!map.data) return false;
+
+		// split the file into chunks at line breaks and parse them in parallel. every chunk keeps its own
+		// arrays, they are concatenated in file order afterwards.
+		const size_t MIN_CHUNK = 1 << 20;
+		int threads = std::max (1, (int)std::thread::hardware_concurrency ());
+		int chunkCount = (int)std::min<size_t> (threads, map.size / MIN_CHUNK + 1);
+		std::vector<const char *> bound (chunkCount + 1, map.data + map.size);
+		bound[0] = map.data;
+		for (int i = 1; i < chunkCount; i++) {
+			const char *p = std::max (bound[i - 1], map.data + map.size / chunkCount * i), *end = map.data + map.size;
+			while (p < end && *p++ != '\n');
+			bound[i] = p;
 		}
+		std::vector<ObjChunk> chunks (chunkCount);
+		ThreadPool loader (chunkCount);
+		loader.ParallelFor (chunkCount, [&] (int i, int) { ParseObj (bound[i], bound[i + 1], chunks[i]); });
+
+		// obj index starts from 1, index 0 is the default value for missing uv/normal.
+		// chunk i's data goes right after chunk i-1's, every chunk is copied by its own thread.
+		std::vector<size_t> base (chunkCount * 4 + 4, 0);
+		for (int i = 0; i < chunkCount; i++) {
+			base[i * 4 + 4] = base[i * 4] + chunks[i].pos.size (), base[i * 4 + 5] = base[i * 4 + 1] + chunks[i].uv.size ();
+			base[i * 4 + 6] = base[i * 4 + 2] + chunks[i].normal.size (), base[i * 4 + 7] = base[i * 4 + 3] + chunks[i].corners.size ();
+		}
+		std::vector<Vector4> pos (base[chunkCount * 4] + 1, { 0 }), uv (base[chunkCount * 4 + 1] + 1, { 0 }), normal (base[chunkCount * 4 + 2] + 1, { 0 });
+		std::vector<Index> corners (base[chunkCount * 4 + 3]);
+		loader.ParallelFor (chunkCount, [&] (int i, int) {
+			ObjChunk &chunk = chunks[i];
+			const size_t *b = &base[i * 4];
+			std::copy (chunk.pos.begin (), chunk.pos.end (), pos.begin () + b[0] + 1);
+			std::copy (chunk.uv.begin (), chunk.uv.end (), uv.begin () + b[1] + 1);
+			std::copy (chunk.normal.begin (), chunk.normal.end (), normal.begin () + b[2] + 1);
+			for (size_t j = 0; j < chunk.corners.size (); j++) {
+				Index index = chunk.corners[j];
+				if (chunk.relative[j] & 1) index.pos += (int)b[0];
+				if (chunk.relative[j] & 2) index.uv += (int)b[1];
+				if (chunk.relative[j] & 4) index.normal += (int)b[2];
+				corners[b[3] + j] = index;
+			} // negative index counts back from the current line, which may reach into previous chunks
+			chunk = ObjChunk ();
+		});
+		Weld (pos, normal, uv, corners);
+		return uv.size () > 1;
 	} // obj is a text base model format
+
+	struct ObjChunk {
+		std::vector<Vector4> pos, normal, uv;
+		std::vector<Index> corners; // 3 per triangle
+		std::vector<unsigned char> relative; // bit 0/1/2 set: pos/uv/normal index was negative, and is relative to this chunk's data
+	};
+
+	static void ParseObj (const char *p, const char *end, ObjChunk &out) {
+		std::vector<Index> poly;
+		std::vector<unsigned char> polyRelative;
+		while (p < end) {
+			SkipSpaces (p, end);
+			if (end - p > 1 && p[0] == 'v') {
+				if (p[1] == ' ' || p[1] == '\t') { // load postion. "v -0.983024 -0.156077 0.0964607"
+					p++;
+					float x = ParseFloat (p, end), y = ParseFloat (p, end), z = ParseFloat (p, end);
+					out.pos.push_back ({ x, y, z });
+				} else if (p[1] == 't') { // load uv. "vt -0.05 0.0972793"
+					p += 2;
+					float x = ParseFloat (p, end), y = ParseFloat (p, end);
+					out.uv.push_back ({ x, y });
+				} else if (p[1] == 'n') { // load normal. "vn -0.981591 -0.162468 0.100411"
+					p += 2;
+					float x = ParseFloat (p, end), y = ParseFloat (p, end), z = ParseFloat (p, end);
+					out.normal.push_back ({ x, y, z });
+				}
+			} else if (end - p > 1 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) { // load index. keep in mind that uv/normal index are optional.
+				p++;
+				poly.clear (), polyRelative.clear ();
+				for (;;) { // "f 1/2/3 ...", "f 1//3 ...", "f 1/2 ...", "f 1 ..."
+					SkipSpaces (p, end);
+					if (p == end || !(IsDigit (*p) || *p == '-')) break;
+					Index index = { 0, 0, 0 };
+					unsigned char relative = 0;
+					index.pos = ParseInt (p, end);
+					if (p < end && *p == '/') {
+						if (++p < end && *p != '/') index.uv = ParseInt (p, end);
+						if (p < end && *p == '/') p++, index.normal = ParseInt (p, end);
+					}
+					if (index.pos < 0) index.pos += (int)out.pos.size () + 1, relative |= 1;
+					if (index.uv < 0) index.uv += (int)out.uv.size () + 1, relative |= 2;
+					if (index.normal < 0) index.normal += (int)out.normal.size () + 1, relative |= 4;
+					poly.push_back (index), polyRelative.push_back (relative);
+				}
+				for (size_t i = 2; i < poly.size (); i++) {
+					out.corners.push_back (poly[0]); out.corners.push_back (poly[i - 1]); out.corners.push_back (poly[i]);
+					out.relative.push_back (polyRelative[0]); out.relative.push_back (polyRelative[i - 1]); out.relative.push_back (polyRelative[i]);
+				} // quads and n-gons are split into a triangle fan
+			}
+			while (p < end && *p++ != '\n'); // skip the rest of the line
+		}
+	} // no allocation per line, no locale, no stream
+
+	static inline bool IsDigit (char c) { return c >= '0' && c <= '9'; }
+
+	static inline void SkipSpaces (const char *&p, const char *end) { while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++; }
+
+	static int ParseInt (const char *&p, const char *end) {
+		bool negative = p < end && *p == '-';
+		if (negative) p++;
+		int n = 0;
+		while (p < end && IsDigit (*p)) n = n * 10 + (*p++ - '0');
+		return negative ? -n : n;
+	}
+
+	static float ParseFloat (const char *&p, const char *end) {
+		static const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		SkipSpaces (p, end);
+		bool negative = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+')) p++;
+		uint64_t mantissa = 0;
+		int exponent = 0, digits = 0;
+		for (; p < end && IsDigit (*p); p++) {
+			if (digits < 19) mantissa = mantissa * 10 + (*p - '0'), digits += mantissa != 0;
+			else exponent++;
+		}
+		if (p < end && *p == '.') {
+			for (p++; p < end && IsDigit (*p); p++) {
+				if (digits < 19) mantissa = mantissa * 10 + (*p - '0'), digits += mantissa != 0, exponent--;
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			if (++p < end && *p == '+') p++;
+			exponent += ParseInt (p, end);
+		}
+		double value = (double)mantissa;
+		if (exponent < 0) value = exponent >= -22 ? value / POW10[-exponent] : value * std::pow (10.0, exponent);
+		else if (exponent > 0) value = exponent <= 22 ? value * POW10[exponent] : value * std::pow (10.0, exponent);
+		return (float)(negative ? -value : value);
+	} // at most 19 significant digits, more than enough for a float
+
+	void Weld (const std::vector<Vector4> &pos, const std::vector<Vector4> &normal, const std::vector<Vector4> &uv, const std::vector<Index> &corners) {
+		struct Slot { Index key; uint32_t id; };
+		auto Hash = [] (const Index &k) {
+			uint32_t h = (uint32_t)k.pos * 0x9E3779B1u ^ (uint32_t)k.uv * 0x85EBCA77u ^ (uint32_t)k.normal * 0xC2B2AE3Du;
+			return h ^ (h >> 15);
+		};
+		const uint32_t EMPTY = 0xffffffffu;
+		size_t capacity = 1024, expected = std::max (pos.size (), std::max (uv.size (), normal.size ()));
+		while (capacity < expected * 2) capacity *= 2; // most meshes have about as many vertices as their largest attribute array
+		std::vector<Slot> table (capacity, { { 0, 0, 0 }, EMPTY });
+		auto Insert = [&] (const Index &index, uint32_t id) -> uint32_t {
+			size_t mask = table.size () - 1, h = Hash (index) & mask;
+			for (; table[h].id != EMPTY; h = (h + 1) & mask) {
+				const Index &k = table[h].key;
+				if (k.pos == index.pos && k.uv == index.uv && k.normal == index.normal) return table[h].id;
+			}
+			table[h] = { index, id };
+			return id;
+		}; // returns the id of the existing vertex, or id if index is new
+
+		posBuffer.clear (); normalBuffer.clear (); uvBuffer.clear (); indexBuffer.clear ();
+		posBuffer.reserve (expected); normalBuffer.reserve (expected); uvBuffer.reserve (expected);
+		indexBuffer.reserve (corners.size ());
+		for (auto index : corners) {
+			if (index.pos < 0 || index.pos >= (int)pos.size ()) index.pos = 0;
+			if (index.uv < 0 || index.uv >= (int)uv.size ()) index.uv = 0;
+			if (index.normal < 0 || index.normal >= (int)normal.size ()) index.normal = 0;
+			uint32_t id = Insert (index, (uint32_t)posBuffer.size ());
+			if (id == posBuffer.size ()) {
+				posBuffer.push_back (pos[index.pos]); normalBuffer.push_back (normal[index.normal]); uvBuffer.push_back (uv[index.uv]);
+				if (posBuffer.size () * 2 > table.size ()) {
+					std::vector<Slot> old (table.size () * 2, { { 0, 0, 0 }, EMPTY });
+					old.swap (table);
+					for (auto &slot : old) if (slot.id != EMPTY) Insert (slot.key, slot.id);
+				} // keep the load factor under 1/2
+			}
+			indexBuffer.push_back (id);
+		}
+	} // every unique (pos, uv, normal) tuple becomes one vertex, so the vertex shader runs once per vertex instead of once per corner
+}; // geometry only, shared between every model(instance) that uses it
+
+struct ResourceCache {
+	std::mutex mutex;
+	std::map<std::string, std::weak_ptr<const Mesh>> meshes;
+	std::map<std::string, std::weak_ptr<const Texture>> textures;
+
+	std::shared_ptr<const Mesh> GetMesh (const std::string &file) {
+		std::lock_guard<std::mutex> lock (mutex);
+		auto mesh = meshes[file].lock ();
+		if (!mesh) meshes[file] = mesh = std::make_shared<const Mesh> (file);
+		return mesh;
+	}
+
+	std::shared_ptr<const Texture> GetTexture (const std::string &file) {
+		std::lock_guard<std::mutex> lock (mutex);
+		auto texture = textures[file].lock ();
+		if (!texture) {
+			auto t = std::make_shared<Texture> ();
+			if (!LoadBmp (*t, file)) return nullptr;
+			textures[file] = texture = t;
+		}
+		return texture;
+	}
+
+	static ResourceCache &Global () {
+		static ResourceCache cache;
+		return cache;
+	}
+}; // every file is loaded once and stays immutable, it is freed when the last user lets go of it
+
+struct Model {
+	std::shared_ptr<const Mesh> mesh;
+	Material material;
+	Matrix4 worldMat;
+
+	Model (std::string name, const Vector4 &pos, Material m) : Model (LoadMesh (name), CreateModelMatrix (pos), m) {
+		if (mesh->hasUv && !material.texture) // load texture only if the model has uv data.
+			material.texture = ResourceCache::Global ().GetTexture (name + ".bmp");
+	}
+
+	Model (std::shared_ptr<const Mesh> m, const Matrix4 &world, Material mat) : mesh (m), material (mat), worldMat (world) {}
+
+	static std::shared_ptr<const Mesh> LoadMesh (const std::string &name) {
+		if (std::ifstream (name + ".cmesh", std::ios::binary)) {
+			std::shared_ptr<const Mesh> mesh = ResourceCache::Global ().GetMesh (name + ".cmesh");
+			if (!mesh->indexBuffer.empty ()) return mesh; // cobra_convert never writes an empty mesh
+			printf ("%s.cmesh: not a valid mesh file, loading %s.obj\n", name.c_str (), name.c_str ());
+		}
+		return ResourceCache::Global ().GetMesh (name + ".obj");
+	} // a converted mesh wins over the obj, see cobra_convert
+}; // one placement of a mesh in the world
+
+struct Instance { Matrix4 worldMat; Material material; };
+
+struct Keyframe { float time; Vector4 eye, at, light; }; // camera and light placement at a point in time
+
+Keyframe SampleKeyframes (const std::vector<Keyframe> &keys, float time) {
+	size_t i = 1;
+	while (i < keys.size () && keys[i].time < time) i++;
+	if (i >= keys.size () || time <= keys[i - 1].time) return keys[std::min (i, keys.size ()) - 1];
+	const Keyframe &a = keys[i - 1], &b = keys[i];
+	float f = (time - a.time) / (b.time - a.time);
+	return{ time, a.eye + (b.eye - a.eye) * f, a.at + (b.at - a.at) * f, a.light + (b.light - a.light) * f };
+} // linear interpolation, keys must be sorted by time
+
+// one image: what is drawn, from where, and the file it goes to. the models only point into the ResourceCache,
+// so thousands of scenes over the same few meshes and textures cost little memory and load every file once.
+struct Scene {
+	int width = 1024, height = 768, samples = 1;
+	float fov = (float)M_PI_2;
+	Vector4 eye = { 0.0f, 3.0f, 5.0f }, at = { 0.0f, 0.0f, 0.0f };
+	Light light = { { -10.0f, 30.0f, 30.0f }, { 0.5f, 0.0f, 0.0f, 0 }, { 0.8f, 0.8f, 0.8f, 0 }, { 0.5f, 0.5f, 0.5f, 0 } };
+	std::vector<PointLight> lights;
+	std::vector<Model> models, wireframes; // solid models are drawn first, then the wireframe only ones
+	bool prepass = false; // depth only pass over the solid models first
+	std::string output;
 };
 
+// scene file, one command per line, '#' starts a comment. "scene" starts a new scene, the other commands add to it:
+//   scene thumb_0001.png 160x120
+//   camera eyeX eyeY eyeZ atX atY atZ
+//   light x y z
+//   pointlight x y z r g b radius
+//   model res/sphere x y z ka kd ks
+//   wireframe res/cube x y z ka kd ks
+//   msaa 4
+//   prepass
+bool LoadScenes (const std::string &file, std::vector<Scene> &scenes) {
+	std::ifstream ifs (file);
+	if (!ifs) return false;
+	std::string line, key;
+	for (int n = 1; std::getline (ifs, line); n++) {
+		std::istringstream ls (line);
+		if (!(ls >> key) || key[0] == '#') continue;
+		bool ok = true;
+		if (key == "scene") {
+			scenes.emplace_back ();
+			std::string size;
+			ok = (bool)(ls >> scenes.back ().output);
+			if (ok && ls >> size) ok = sscanf (size.c_str (), "%dx%d", &scenes.back ().width, &scenes.back ().height) == 2 && scenes.back ().width > 0 && scenes.back ().height > 0;
+		} else if (scenes.empty ()) ok = false; // everything else belongs to a scene
+		else {
+			Scene &scene = scenes.back ();
+			if (key == "camera") ok = (bool)(ls >> scene.eye.x >> scene.eye.y >> scene.eye.z >> scene.at.x >> scene.at.y >> scene.at.z);
+			else if (key == "light") ok = (bool)(ls >> scene.light.pos.x >> scene.light.pos.y >> scene.light.pos.z);
+			else if (key == "pointlight") {
+				PointLight l = { { 0, 0, 0, 1 }, { 0, 0, 0, 0 }, 0 };
+				ok = (bool)(ls >> l.pos.x >> l.pos.y >> l.pos.z >> l.color.x >> l.color.y >> l.color.z >> l.radius);
+				if (ok) scene.lights.push_back (l);
+			} else if (key == "model" || key == "wireframe") {
+				std::string name;
+				Vector4 pos = { 0 };
+				Material material = { 0 };
+				ok = (bool)(ls >> name >> pos.x >> pos.y >> pos.z >> material.ka >> material.kd >> material.ks);
+				if (ok) {
+					std::vector<Model> &list = key == "model" ? scene.models : scene.wireframes;
+					list.push_back (Model (name, pos, material));
+					if (list.back ().mesh->indexBuffer.empty ()) printf ("%s:%d: %s has no triangles\n", file.c_str (), n, name.c_str ()); // drawn as nothing
+				}
+			} else if (key == "msaa") ok = (bool)(ls >> scene.samples);
+			else if (key == "prepass") scene.prepass = true;
+			else ok = false;
+		}
+		if (!ok) {
+			printf ("%s:%d: cannot parse \"%s\"\n", file.c_str (), n, line.c_str ());
+			return false;
+		}
+	}
+	return true;
+} // appends to scenes, the models are loaded right away
+
 struct Renderer {
 	int width, height;
-	std::vector<Vector4> frameBuffer;
-	std::vector<float> depthBuffer;
-	Matrix4 projMat, viewMat, mvMat, mvpMat, nmvMat;
+	Vector4 clearColor = { 0, 0, 0.34f, 0 };
+	ColorBuffer frameBuffer;
+	DepthBuffer depthBuffer; // one depth per sample when multisampled
+	Matrix4 projMat, viewMat, nvMat;
 	Light light;
 
-	Renderer (int w, int h) : width (w), height (h), frameBuffer (w * h, { 0, 0, 0.34f, 0 }), depthBuffer (w * h, std::numeric_limits<float>::max ()) {	}
+	// local lights. after the view is known every light is projected to the screen, and each raster tile
+	// gets the list of lights whose bounding box touches it(tileLightStart/tileLights, one flat array).
+	struct ViewLight { Vector4 pos, color; float radius2; };
+	struct TileLights { const uint32_t *index; int count; };
+	std::vector<PointLight> lights;
+	std::vector<ViewLight> viewLights;
+	std::vector<uint32_t> tileLightStart, tileLights;
+	bool lightsDirty = true;
+
+	// triangles are binned into screen tiles after the vertex stage, every tile is then
+	// rasterized by one thread, so no two threads ever touch the same pixel.
+	static const int TILE_SIZE = 64;
+	struct Triangle { Vertex v[3]; };
 
-	void SetFrustum (float hfov, float ratio, float n, float f) { projMat = CreateProjectionMatrix (hfov, ratio, n, f); }
+	// everything that belongs to one draw call, it lives on the stack of DrawMesh (). the renderer itself only keeps the
+	// camera, lights and buffers, so a draw never depends on what the previous one left behind.
+	struct DrawState { Material material; Matrix4 mvMat, mvpMat, nmvMat; Vector4 lightViewPos; };
+	struct VertexCache { std::vector<Vector4> pos, clip, viewPos, normal; std::vector<unsigned char> outcode, group; std::vector<uint32_t> meshlets; };
+	static const int VERTEX_BATCH = 4096, VERTEX_GROUP = 16; // meshes with meshlets only transform the groups that visible meshlets use
+	VertexCache cache;
 
-	void SetCamera (const Vector4 &look, const Vector4 &at) { viewMat = CreateViewMatrix (look, at, { 0.0f, 1.0f, 0.0f }); }
+	// the per draw counters and timers are always kept. the per pixel counters(pixels*, textureSamples) and the
+	// heat map need COBRA_STATS, without it they stay 0 and the raster loops do not touch them at all.
+	struct RenderStats {
+		long long modelsDrawn, modelsCulled, modelsOccluded, verticesShaded;
+		long long meshletsDrawn, meshletsOutside, meshletsBackface;
+		long long trianglesSubmitted, trianglesOutside, trianglesBackface, trianglesClipped, trianglesOccluded, trianglesRasterized;
+		long long blocksOccluded, pixelsTested, pixelsCovered, pixelsDepthRejected, pixelsShaded, textureSamples;
+		double vertexTime, rasterTime, shadeTime; // seconds. forward mode shades while rasterizing, shadeTime is Resolve ()
+
+		RenderStats &operator+= (const RenderStats &rhs) {
+			modelsDrawn += rhs.modelsDrawn, modelsCulled += rhs.modelsCulled, modelsOccluded += rhs.modelsOccluded, verticesShaded += rhs.verticesShaded;
+			meshletsDrawn += rhs.meshletsDrawn, meshletsOutside += rhs.meshletsOutside, meshletsBackface += rhs.meshletsBackface;
+			trianglesSubmitted += rhs.trianglesSubmitted, trianglesOutside += rhs.trianglesOutside, trianglesBackface += rhs.trianglesBackface;
+			trianglesClipped += rhs.trianglesClipped, trianglesOccluded += rhs.trianglesOccluded, trianglesRasterized += rhs.trianglesRasterized;
+			blocksOccluded += rhs.blocksOccluded, pixelsTested += rhs.pixelsTested, pixelsCovered += rhs.pixelsCovered, pixelsDepthRejected += rhs.pixelsDepthRejected;
+			pixelsShaded += rhs.pixelsShaded, textureSamples += rhs.textureSamples;
+			vertexTime += rhs.vertexTime, rasterTime += rhs.rasterTime, shadeTime += rhs.shadeTime;
+			return *this;
+		}
+	};
+	struct PixelStats { long long blocksOccluded, tested, covered, depthRejected, shaded, textureSamples; char pad[64]; }; // one per thread, padded against false sharing
+	RenderStats stats = {}; // everything since the last Clear (), deferred shading is only counted here
+	RenderStats drawStats = {}; // the last DrawModel/DrawMesh call
+	std::vector<PixelStats> threadStats;
+	std::vector<uint16_t> heatMap; // covered fragments per pixel, see SetHeatMap ()
+	int tileCols, tileRows, blockCols, blockRows;
+	std::vector<Triangle> triangles;
+	std::vector<std::vector<int>> tileBins;
+	std::vector<int> activeTiles;
+	ThreadPool pool;
+
+	// hierarchical z: the nearest and farthest stored depth of every BLOCK_SIZE block, and the farthest of every tile.
+	// whole models, triangles and blocks that are behind the farthest depth are rejected before rasterization.
+	// a block written during a draw is marked dirty and its farthest depth is rebuilt when its tile is done,
+	// until then the old value is too far, which is safe. the nearest depth is lowered right away.
+	std::vector<uint32_t> blockMin, blockMax, tileMax;
+	std::vector<unsigned char> blockDirty;
+	uint32_t depthBias = 0; // 0 passes on less, 1 on less or equal, so a color pass can follow a depth prepass
+	bool occlusionCulling = true, depthOnly = false;
+
+	// visibility buffer(deferred) mode: the raster pass only writes depth and a (draw, triangle) id per pixel.
+	struct VisibilityId { uint32_t draw, triangle; };
+	struct DrawRecord;
+	typedef void (Renderer::*ShadeSpanFunc) (const DrawRecord &draw, int y, int x0, int x1, PixelStats &counters);
+	struct DrawRecord { Material material; Vector4 lightViewPos; std::vector<Triangle> triangles; ShadeSpanFunc shade; };
+	static const uint32_t WIREFRAME_DRAW = 0xfffffffe, NO_DRAW = 0xffffffff;
+	bool deferred = false;
+	std::vector<VisibilityId> idBuffer;
+	std::vector<DrawRecord> drawRecords;
+
+	// multisampling: coverage and depth are tested per sample, the pixel shader still runs once per pixel and
+	// triangle, and its color goes to every sample that passed. Resolve () averages the samples into frameBuffer.
+	// samples of a pixel are stored next to each other, pixel i owns [i * samples, (i + 1) * samples).
+	static const int MAX_SAMPLES = 8;
+	int samples = 1;
+	ColorBuffer sampleBuffer { 0, 0, COLOR_RGBA8, Vector4 () };
+
+	Renderer (int w, int h, ColorFormat color = COLOR_RGBA8, DepthFormat depth = DEPTH_32F, int threads = 0) : width (w), height (h), frameBuffer (w, h, color, clearColor), depthBuffer (w, h, depth),
+		tileCols ((w + TILE_SIZE - 1) / TILE_SIZE), tileRows ((h + TILE_SIZE - 1) / TILE_SIZE),
+		blockCols ((w + BLOCK_SIZE - 1) / BLOCK_SIZE), blockRows ((h + BLOCK_SIZE - 1) / BLOCK_SIZE), tileBins (tileCols * tileRows),
+		pool (threads > 0 ? threads : std::max (1, (int)std::thread::hardware_concurrency ())) { ClearDepth (); } // 0 threads means one per core
+
+	void SetThreadCount (int n) { pool.Resize (std::max (1, n)); } // 1 means rasterize on the calling thread only
+
+	void SetDeferred (bool on) {
+		if (on) SetSamples (1); // the visibility buffer holds one triangle per pixel
+		Resolve ();
+		deferred = on;
+		idBuffer.assign (on ? width * height : 0, { NO_DRAW, 0 });
+	}
+
+	void SetSamples (int n) {
+		n = n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+		if (n > 1 && deferred) SetDeferred (false);
+		Resolve ();
+		samples = n;
+		DepthBuffer depth (width * n, height, depthBuffer.format);
+		depth.invNear = depthBuffer.invNear, depth.depthScale = depthBuffer.depthScale;
+		depthBuffer = std::move (depth);
+		ClearDepth ();
+		sampleBuffer = ColorBuffer (n > 1 ? width * n : 0, n > 1 ? height : 0, frameBuffer.format, clearColor);
+	} // 1, 2, 4 or 8 samples per pixel, multisampling only works in forward mode
+
+	static const float (*SamplePattern (int n))[2] {
+		static const float pattern2[2][2] = { { 0.25f, 0.25f }, { -0.25f, -0.25f } };
+		static const float pattern4[4][2] = { { -0.125f, -0.375f }, { 0.375f, -0.125f }, { -0.375f, 0.125f }, { 0.125f, 0.375f } };
+		static const float pattern8[8][2] = { { 0.0625f, -0.1875f }, { -0.0625f, 0.1875f }, { 0.3125f, 0.0625f }, { -0.1875f, -0.3125f },
+			{ -0.3125f, 0.1875f }, { -0.4375f, -0.0625f }, { 0.1875f, 0.4375f }, { 0.4375f, -0.4375f } };
+		return n == 8 ? pattern8 : n == 4 ? pattern4 : pattern2;
+	} // sample offsets from the pixel center, the usual rotated grid patterns so near horizontal and vertical edges get distinct steps
+
+	void Clear () {
+		frameBuffer.Clear (clearColor);
+		ClearDepth ();
+		sampleBuffer.Clear (clearColor);
+		std::fill (heatMap.begin (), heatMap.end (), 0);
+		stats = {};
+		if (deferred) std::fill (idBuffer.begin (), idBuffer.end (), VisibilityId { NO_DRAW, 0 });
+		drawRecords.clear ();
+	} // start a new frame, anything drawn but not resolved yet is dropped
+
+	void ClearDepth () {
+		depthBuffer.Clear ();
+		uint32_t far = depthBuffer.Load (0);
+		blockMin.assign (blockCols * blockRows, far), blockMax.assign (blockCols * blockRows, far), tileMax.assign (tileCols * tileRows, far);
+		blockDirty.assign (blockCols * blockRows, 0);
+		depthBias = 0;
+	} // also ends a depth prepass
+
+	void SetOcclusionCulling (bool on) { occlusionCulling = on; } // hierarchical z rejection of models, triangles and blocks
+
+	void SetHeatMap (bool on) { heatMap.assign (on && COBRA_STATS ? width * height : 0, 0); } // needs a COBRA_STATS build
+
+	ColorBuffer HeatMapImage (int scale = 0) const {
+		ColorBuffer image (width, height, COLOR_RGBA8, { 0, 0, 0, 0 });
+		if (heatMap.empty ()) return image;
+		if (scale <= 0) scale = std::max (1, (int)*std::max_element (heatMap.begin (), heatMap.end ()));
+		for (int i = 0; i < width * height; i++) {
+			if (!heatMap[i]) continue;
+			float t = std::min (1.0f, (float)heatMap[i] / scale) * 4; // blue, cyan, green, yellow, red
+			float r = Saturate (t - 2), g = t < 1 ? t : Saturate (4 - t), b = Saturate (2 - t);
+			image.Store (i, { r, g, b, 1 });
+		}
+		return image;
+	} // fragments per pixel(depth complexity) as a color ramp, scale is the count that maps to red, 0 means the maximum
+
+	double Overdraw () const { return (double)stats.pixelsCovered / (width * height); } // average depth complexity over the screen, needs COBRA_STATS
+
+	// renders frames sampled evenly over the keyframes' time range, draw () issues the draw calls of one frame.
+	// output () gets every finished frame on its own thread, so encoding frame n overlaps rendering frame n + 1.
+	// buffers is the number of color buffers in flight, 2 or 3 are sensible. returns the achieved frames per second.
+	double RenderFrames (const std::vector<Keyframe> &keys, int frames, const std::function<void ()> &draw,
+		const std::function<void (const ColorBuffer &, int)> &output, int buffers = 2) {
+		if (keys.empty () || frames <= 0) return 0;
+		auto start = std::chrono::steady_clock::now ();
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::vector<ColorBuffer> idle (std::max (1, buffers - 1), ColorBuffer (width, height, frameBuffer.format, clearColor));
+		std::deque<std::pair<ColorBuffer, int>> encode;
+		bool done = false;
+		std::thread encoder ([&] {
+			std::unique_lock<std::mutex> lock (mutex);
+			for (;;) {
+				cond.wait (lock, [&] { return done || !encode.empty (); });
+				if (encode.empty ()) return;
+				auto frame = std::move (encode.front ());
+				encode.pop_front ();
+				lock.unlock ();
+				output (frame.first, frame.second);
+				frame.first.Clear (clearColor); // clearing is off the render thread as well
+				lock.lock ();
+				idle.push_back (std::move (frame.first));
+				cond.notify_all ();
+			}
+		});
+
+		Clear ();
+		float t0 = keys.front ().time, t1 = keys.back ().time;
+		for (int i = 0; i < frames; i++) {
+			Keyframe key = SampleKeyframes (keys, frames > 1 ? t0 + (t1 - t0) * i / (frames - 1) : t0);
+			SetCamera (key.eye, key.at);
+			light.pos = key.light;
+			draw ();
+			Resolve ();
+			{
+				std::unique_lock<std::mutex> lock (mutex);
+				cond.wait (lock, [&] { return !idle.empty (); }); // all buffers in flight, the encoder is the bottleneck
+				std::swap (frameBuffer, idle.back ());
+				encode.emplace_back (std::move (idle.back ()), i);
+				idle.pop_back ();
+			}
+			cond.notify_all ();
+			ClearDepth ();
+			sampleBuffer.Clear (clearColor);
+		}
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			done = true;
+		}
+		cond.notify_all ();
+		encoder.join ();
+		return frames / std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+	} // the models are loaded once by the caller and reused for every frame
+
+	void SetFrustum (float hfov, float ratio, float n, float f) {
+		projMat = CreateProjectionMatrix (hfov, ratio, n, f);
+		depthBuffer.SetRange (n, f);
+		lightsDirty = true;
+	} // set it before drawing, unorm depth is encoded with the near/far planes
+
+	void SetCamera (const Vector4 &look, const Vector4 &at) {
+		viewMat = CreateViewMatrix (look, at, { 0.0f, 1.0f, 0.0f });
+		lightsDirty = true;
+	}
 
 	void SetLight (const Vector4 &pos, const Vector4 &ambi, const Vector4 &diff, const Vector4 &spec) {
 		light.pos = pos; light.ambientColor = ambi; light.diffuseColor = diff;	light.specularColor = spec;
-	} // we support one point light right now.
+	} // the main light, it has no range and lights every pixel
 
-	void DrawModel (Model &model, bool drawTex = true, bool drawWireFrame = false) {
+	void SetLights (const std::vector<PointLight> &l) {
+		lights = l;
+		lightsDirty = true;
+	} // local lights, shading cost only depends on how many of them touch a tile
+
+	void SetScene (const Scene &scene) {
+		SetFrustum (scene.fov, (float)width / (float)height, 0.1f, 1000.0f);
+		SetCamera (scene.eye, scene.at);
+		light = scene.light;
+		SetLights (scene.lights);
+	} // camera and lights of the scene, the renderer keeps its own size and formats
+
+	void DrawScene (const Scene &scene) {
+		if (scene.prepass) for (auto &model : scene.models) DrawDepth (model);
+		for (auto &model : scene.models) DrawModel (model, true, false);
+		for (auto &model : scene.wireframes) DrawModel (model, false, true);
+	} // issues the draw calls only, so RenderFrames () can move the camera between frames
+
+	bool DrawDepth (const Model &model) {
+		BeginBatch ();
+		depthOnly = true;
+		bool drawn = DrawMesh (*model.mesh, model.material, model.worldMat, true, false);
+		depthOnly = false;
+		depthBias = 1;
+		return drawn;
+	} // depth prepass for occluders. the color pass after it tests less or equal, so the same surface passes again
+
+	bool DrawModel (const Model &model, bool drawTex = true, bool drawWireFrame = false) {
+		BeginBatch ();
+		return DrawMesh (*model.mesh, model.material, model.worldMat, drawTex, drawWireFrame);
+	} // returns false if the whole model is culled
+
+	int DrawInstanced (const Mesh &mesh, const std::vector<Instance> &instances, bool drawTex = true, bool drawWireFrame = false) {
+		BeginBatch ();
+		int drawn = 0;
+		for (auto &instance : instances) drawn += DrawMesh (mesh, instance.material, instance.worldMat, drawTex, drawWireFrame);
+		return drawn;
+	} // draw the same mesh once per instance, returns the number of instances that were not culled
+
+	void BeginBatch () {
+		nvMat = CreateNormalMatrix (viewMat);
+		if (lightsDirty) CullLights ();
+	} // per draw setup that does not depend on the instance
+
+	void CullLights () {
+		int tiles = tileCols * tileRows;
+		std::vector<Rect> rects;
+		viewLights.clear ();
+		tileLightStart.assign (tiles + 1, 0);
+		for (auto &l : lights) {
+			Vector4 c = TransformPoint (l.pos, viewMat);
+			float x0 = 1, y0 = 1, x1 = -1, y1 = -1;
+			bool front = false, behind = false;
+			for (int i = 0; i < 8; i++) {
+				Vector4 corner = { c.x + (i & 1 ? l.radius : -l.radius), c.y + (i & 2 ? l.radius : -l.radius), c.z + (i & 4 ? l.radius : -l.radius), 1 };
+				Vector4 clip = TransformHomogeneous (corner, projMat);
+				if (clip.w < 1e-4f) { behind = true; continue; }
+				front = true;
+				x0 = std::min (x0, clip.x / clip.w), x1 = std::max (x1, clip.x / clip.w), y0 = std::min (y0, clip.y / clip.w), y1 = std::max (y1, clip.y / clip.w);
+			} // the projected corners of the bounding box bound the projected sphere
+			if (!front) continue; // completely behind the camera
+			if (behind) x0 = y0 = -1, x1 = y1 = 1; // crosses the camera plane, may cover any part of the screen
+			x0 = std::max (x0, -1.0f), y0 = std::max (y0, -1.0f), x1 = std::min (x1, 1.0f), y1 = std::min (y1, 1.0f);
+			if (x0 > x1 || y0 > y1) continue; // off screen
+			Rect rect = { (int)((x0 + 1) * 0.5f * width) / TILE_SIZE, (int)((y0 + 1) * 0.5f * height) / TILE_SIZE,
+				std::min (tileCols - 1, (int)((x1 + 1) * 0.5f * width) / TILE_SIZE), std::min (tileRows - 1, (int)((y1 + 1) * 0.5f * height) / TILE_SIZE) };
+			for (int ty = rect.y0; ty <= rect.y1; ty++)
+				for (int tx = rect.x0; tx <= rect.x1; tx++) tileLightStart[tx + ty * tileCols + 1]++;
+			viewLights.push_back ({ c, l.color, l.radius * l.radius });
+			rects.push_back (rect);
+		}
+		for (int i = 0; i < tiles; i++) tileLightStart[i + 1] += tileLightStart[i];
+		tileLights.resize (tileLightStart[tiles]);
+		std::vector<uint32_t> fill (tileLightStart.begin (), tileLightStart.end () - 1);
+		for (uint32_t i = 0; i < rects.size (); i++)
+			for (int ty = rects[i].y0; ty <= rects[i].y1; ty++)
+				for (int tx = rects[i].x0; tx <= rects[i].x1; tx++) tileLights[fill[tx + ty * tileCols]++] = i;
+		lightsDirty = false;
+	} // builds the per tile light lists, runs once per view change
+
+	TileLights LightsAt (int x, int y) const {
+		int tile = x / TILE_SIZE + y / TILE_SIZE * tileCols;
+		return{ tileLights.data () + tileLightStart[tile], (int)(tileLightStart[tile + 1] - tileLightStart[tile]) };
+	} // the lights that may touch pixel (x, y)
+
+	bool DrawMesh (const Mesh &model, const Material &material, const Matrix4 &worldMat, bool drawTex, bool drawWireFrame) {
 		// again, using row-major order matrix, the calculation order is "pos * modelMat * viewMat * projMat".
 		// if you are using column-major order matrix, it will be "projMat * viewMat * modelMat * pos".
-		mvMat = model.worldMat * viewMat, mvpMat = mvMat * projMat, nmvMat = mvMat.InvertTranspose ();
+		// normals need (M-1)T, and ((world * view)-1)T == (world-1)T * (view-1)T, only the 3x3 part matters.
+		// the pixel shader needs the light position in view space, the light lives in world space.
+		DrawState draw = { material, worldMat * viewMat, Matrix4 (), CreateNormalMatrix (worldMat) * nvMat, TransformPoint (light.pos, viewMat) };
+		draw.mvpMat = draw.mvMat * projMat;
+		drawStats = {};
+		drawStats.trianglesSubmitted = model.indexBuffer.size () / 3;
+		if (model.indexBuffer.empty ()) {
+			stats += drawStats;
+			return false;
+		} // nothing to draw, e.g. a file that failed to load
+
+		// skip the whole model if its bounding volume is outside the view frustum, before any vertex work
+		if (ModelOutside (model, draw.mvpMat)) {
+			drawStats.modelsCulled++;
+			stats += drawStats;
+			return false;
+		}
+		if (occlusionCulling && ModelOccluded (model, draw.mvpMat)) {
+			drawStats.modelsOccluded++;
+			stats += drawStats;
+			return false;
+		} // or behind what has been drawn already
+		drawStats.modelsDrawn++;
+		auto stageStart = std::chrono::steady_clock::now ();
+
+		auto VertexShader = [&] (int begin, int end) {
+			TransformBatch<TRANSFORM_HOMOGENEOUS> (&model.posBuffer[begin], end - begin, draw.mvpMat, &cache.clip[begin]);
+			TransformBatch<TRANSFORM_POINT> (&model.posBuffer[begin], end - begin, draw.mvMat, &cache.viewPos[begin]);
+			TransformBatch<TRANSFORM_DIR> (&model.normalBuffer[begin], end - begin, draw.nmvMat, &cache.normal[begin]);
+		}; // note that transform point/dir/normal require different matrix. vertices [begin, end) at once
+
+		int vertexCount = (int)model.posBuffer.size ();
+		bool meshlets = !model.meshlets.empty ();
+		if (meshlets) CullMeshlets (model, draw, worldMat);
+		else drawStats.verticesShaded = vertexCount;
+
+		// post-transform vertex cache: every welded vertex is transformed exactly once, in batches,
+		// before primitive assembly. the results are kept in separate streams(soa).
+		cache.pos.resize (vertexCount); cache.clip.resize (vertexCount); cache.viewPos.resize (vertexCount); cache.normal.resize (vertexCount); cache.outcode.resize (vertexCount);
+		pool.ParallelFor ((vertexCount + VERTEX_BATCH - 1) / VERTEX_BATCH, [&] (int batch, int) {
+			// run vertex shader for every vertex of the batch, or every group of it that a visible meshlet uses
+			int begin = batch * VERTEX_BATCH, end = std::min (vertexCount, begin + VERTEX_BATCH), step = meshlets ? VERTEX_GROUP : VERTEX_BATCH;
+			for (int first = begin; first < end; first += step) {
+				int last = std::min (end, first + step);
+				if (meshlets && !cache.group[first / VERTEX_GROUP]) continue;
+				VertexShader (first, last);
+				for (int i = first; i < last; i++) {
+					// check the vertex inside or outside the view frustum
+					cache.outcode[i] = Outcode (cache.clip[i]);
+
+					// convert to screen coordinate, vertices that need clipping are converted after clipping
+					if (!(cache.outcode[i] & CLIP_PLANES)) cache.pos[i] = ClipToScreen (cache.clip[i]);
+				}
+			}
+		});
+
+		triangles.clear ();
+		size_t ranges = meshlets ? cache.meshlets.size () : 1;
+		for (size_t r = 0; r < ranges; r++) {
+			const Meshlet *m = meshlets ? &model.meshlets[cache.meshlets[r]] : nullptr;
+			size_t first = m ? m->firstIndex : 0, last = m ? m->firstIndex + m->triangleCount * 3 : model.indexBuffer.size ();
+			for (size_t t = first; t + 2 < last; t += 3) {
+				const uint32_t *index = &model.indexBuffer[t];
+				unsigned char oc0 = cache.outcode[index[0]], oc1 = cache.outcode[index[1]], oc2 = cache.outcode[index[2]];
+
+				// all three vertices are outside the same plane
+				if (oc0 & oc1 & oc2) {
+					drawStats.trianglesOutside++;
+					continue;
+				}
+
+				Triangle tri;
+				Vertex *outVertex = tri.v;
+				for (int i = 0; i < 3; i++) {
+					outVertex[i].pos = cache.pos[index[i]]; outVertex[i].viewPos = cache.viewPos[index[i]];
+					outVertex[i].normal = cache.normal[index[i]]; outVertex[i].uv = model.uvBuffer[index[i]];
+					outVertex[i].color = { 0 };
+				} // primitive assembly
+
+				// skip triangles that are invisible
+				if (BackFaceCulling (outVertex[0].viewPos, outVertex[1].viewPos, outVertex[2].viewPos)) {
+					drawStats.trianglesBackface++;
+					continue;
+				}
 
-		// we need light position(in view space) in pixel shader
-		light.viewPos = TransformPoint (light.pos, mvMat);
+				// crossing the near/far plane or the guard band, the side planes never need clipping
+				if ((oc0 | oc1 | oc2) & CLIP_PLANES) {
+					for (int i = 0; i < 3; i++) outVertex[i].pos = cache.clip[index[i]];
+					ClipTriangle (tri, oc0 | oc1 | oc2);
+					continue;
+				}
 
-		auto VertexShader = [this] (const Vector4 &pos, const Vector4 &normal, const Vector4 &uv, Vertex &outVertex) {
-			outVertex.pos = TransformPoint (pos, mvpMat);
-			outVertex.viewPos = TransformPoint (pos, mvMat);
-			outVertex.normal = TransformDir (normal, nmvMat);
-			outVertex.uv = uv;
-		}; // note that transform point/dir/normal require different matrix.
+				BinTriangle (tri);
+			} // travers all triangles
+		} // the visible meshlets, or the whole index buffer
 
-		for (auto &index : model.indexBuffer) {
-			Vertex outVertex[3];
-			bool badTriangle = false;
+		drawStats.trianglesRasterized = triangles.size ();
+		drawStats.vertexTime = Elapsed (stageStart); // vertex shading, assembly, clipping and binning
 
-			for (int i = 0; i < 3; i++) {
-				// run vertex shader for every vertex
-				VertexShader (model.posBuffer[index.pos[i]], model.normalBuffer[index.normal[i]], model.uvBuffer[index.uv[i]], outVertex[i]);
+		// pick the pipeline variant once, the raster loops below only call it
+		int shade = ShadeVariant (material);
+		FillFunc fill = deferred ? &Renderer::FillTriangle<SHADE_VISIBILITY> : samples > 1 ? Variants ().fillSamples[shade] : Variants ().fill[shade];
+		if (depthOnly) fill = samples > 1 ? &Renderer::FillTriangleMultisample<SHADE_DEPTH> : &Renderer::FillTriangle<SHADE_DEPTH>;
 
-				if (outVertex[i].pos.z < 0.0f || outVertex[i].pos.z > 1.0f) {
-					badTriangle = true;	break;
-				} // check the vertex inside or outside the view frustum
+		// in visibility buffer mode the screen space triangles are kept until Resolve()
+		uint32_t drawId = (uint32_t)drawRecords.size ();
+		// the vector is handed over, not copied, and rasterized from the record
+		const std::vector<Triangle> *binned = &triangles;
+		if (deferred && drawTex && !depthOnly) {
+			drawRecords.push_back ({ material, draw.lightViewPos, std::vector<Triangle> (), Variants ().shade[shade] });
+			drawRecords.back ().triangles.swap (triangles);
+			binned = &drawRecords.back ().triangles;
+		}
 
-				Ndc2Screen (outVertex[i].pos); // convert to screen coordinate
-			} // travers all three vertex
+		// every tile replays its triangles in submission order, which keeps the result identical to drawing them one by one
+		threadStats.assign (pool.Size (), PixelStats ());
+		pool.ParallelFor ((int)activeTiles.size (), [&] (int i, int thread) {
+			int tile = activeTiles[i], tx = tile % tileCols, ty = tile / tileCols;
+			Rect rect = { tx * TILE_SIZE, ty * TILE_SIZE, std::min (width, (tx + 1) * TILE_SIZE) - 1, std::min (height, (ty + 1) * TILE_SIZE) - 1 };
+			for (int t : tileBins[tile]) {
+				const Vertex *v = (*binned)[t].v;
 
-			// skip triangles that are invisible
-			if (badTriangle || BackFaceCulling (outVertex[0].viewPos, outVertex[1].viewPos, outVertex[2].viewPos)) continue;
+				// texture mode drawing
+				if (drawTex) (this->*fill) (draw, v[0], v[1], v[2], rect, drawId, (uint32_t)t, threadStats[thread]);
 
-			// texture mode drawing
-			if (drawTex) FillTriangle (model, outVertex[0], outVertex[1], outVertex[2]);
+				// wireframe mode drawing
+				if (drawWireFrame) DrawTriangle (v[0], v[1], v[2], { 0, 1.0f, 0, 0 }, rect);
+			}
+			if (occlusionCulling) UpdateHiZ (tile);
+		});
 
-			// wireframe mode drawing
-			if (drawWireFrame) DrawTriangle (outVertex[0], outVertex[1], outVertex[2], { 0, 1.0f, 0, 0 });
-		} // travers all triangles
+		for (int tile : activeTiles) tileBins[tile].clear ();
+		activeTiles.clear ();
+		drawStats.rasterTime = Elapsed (stageStart);
+		MergePixelStats (drawStats);
+		stats += drawStats;
+		return true;
 	}
 
-	inline void Ndc2Screen (Vector4 &pos) {
-		pos.x = (pos.x + 1)* 0.5f * width; pos.y = (pos.y + 1)* 0.5f * height; pos.z = pos.w; pos.w = 1.0f / pos.w;
-	} // convert from normalized device coordinate to screen coordinate
+	// outcode bits, a vertex is outside the plane if the bit is set. the rasterizer works on the whole guard band,
+	// so triangles are only clipped against near/far, or in the rare case that they reach outside the guard band.
+	enum {
+		OUT_LEFT = 1, OUT_RIGHT = 2, OUT_BOTTOM = 4, OUT_TOP = 8, OUT_NEAR = 16, OUT_FAR = 32, OUT_GUARD = 64,
+		CLIP_PLANES = OUT_NEAR | OUT_FAR | OUT_GUARD
+	};
+	static constexpr float GUARD_BAND = 8.0f; // in multiples of the viewport
 
-	static inline bool BackFaceCulling (const Vector4 &p0, const Vector4 &p1, const Vector4 &p2) { return (p0.Dot ((p1 - p0).Cross (p2 - p0)) >= 0); }
+	static inline unsigned char Outcode (const Vector4 &c) {
+		float g = c.w * GUARD_BAND;
+		return (unsigned char)((c.x < -c.w ? OUT_LEFT : 0) | (c.x > c.w ? OUT_RIGHT : 0) | (c.y < -c.w ? OUT_BOTTOM : 0) | (c.y > c.w ? OUT_TOP : 0) |
+			(c.z < 0.0f ? OUT_NEAR : 0) | (c.z > c.w ? OUT_FAR : 0) | (c.x < -g || c.x > g || c.y < -g || c.y > g ? OUT_GUARD : 0));
+	} // clip space z in [0, w] is the visible depth range, same as the old "ndc z in [0, 1]" check
+
+	inline Vector4 ClipToScreen (const Vector4 &c) {
+		float invW = 1.0f / c.w;
+		Vector4 pos = { c.x * invW, c.y * invW, c.z * invW, c.w };
+		Ndc2Screen (pos);
+		return pos;
+	} // perspective divide(one division, three multiplies), then viewport transform
 
-	void FillTriangle (Model &model, const Vertex &v0, const Vertex &v1, const Vertex &v2) {
-		auto PixelShader = [&model, this] (Vertex &v) -> Vector4 {
-			auto ldir = (light.viewPos - v.viewPos).Normalize ();
-			auto lambertian = std::max (0.0f, ldir.Dot (v.normal));
-			auto specular = 0.0f;
-			if (lambertian > 0) {
-				auto viewDir = (-v.viewPos).Normalize ();
-				auto half = (ldir + viewDir).Normalize ();
-				auto angle = std::max (0.0f, half.Dot (v.normal));
-				specular = std::pow (angle, 16.0f);
+	void ClipTriangle (const Triangle &tri, unsigned char planes) {
+		// sutherland-hodgman, one plane after another. pos holds the clip space position here,
+		// every attribute is linear in clip space so all of them are interpolated the same way.
+		auto Distance = [] (const Vertex &v, int plane) {
+			const Vector4 &c = v.pos;
+			switch (plane) {
+			case OUT_NEAR: return c.z;
+			case OUT_FAR: return c.w - c.z;
+			case OUT_LEFT: return c.x + c.w * GUARD_BAND;
+			case OUT_RIGHT: return c.w * GUARD_BAND - c.x;
+			case OUT_BOTTOM: return c.y + c.w * GUARD_BAND;
+			default: return c.w * GUARD_BAND - c.y;
+			}
+		};
+		Vertex poly[2][12];
+		int count = 3, cur = 0;
+		std::copy (tri.v, tri.v + 3, poly[0]);
+		const int PLANES[] = { OUT_NEAR, OUT_FAR, OUT_LEFT, OUT_RIGHT, OUT_BOTTOM, OUT_TOP };
+		for (int plane : PLANES) {
+			if (!(planes & (plane == OUT_NEAR || plane == OUT_FAR ? plane : OUT_GUARD))) continue;
+			const Vertex *in = poly[cur];
+			Vertex *out = poly[cur ^ 1];
+			int n = 0;
+			for (int i = 0; i < count; i++) {
+				const Vertex &a = in[i], &b = in[(i + 1) % count];
+				float da = Distance (a, plane), db = Distance (b, plane);
+				if (da >= 0) out[n++] = a;
+				if ((da >= 0) != (db >= 0)) {
+					float t = da / (da - db);
+					out[n++] = { a.pos + (b.pos - a.pos) * t, a.uv + (b.uv - a.uv) * t, a.normal + (b.normal - a.normal) * t, a.viewPos + (b.viewPos - a.viewPos) * t, { 0 } };
+				}
 			}
-			return (TextureLookup (model.material.texture, v.uv.x, v.uv.y) * (light.ambientColor * model.material.ka + light.diffuseColor * lambertian * model.material.kd) + light.specularColor * specular * model.material.ks);
-		}; // blinn-phong shading.
+			count = n, cur ^= 1;
+			if (count < 3) return;
+		}
+		for (int i = 0; i < count; i++) poly[cur][i].pos = ClipToScreen (poly[cur][i].pos);
+		for (int i = 2; i < count; i++) {
+			Triangle out = { { poly[cur][0], poly[cur][i - 1], poly[cur][i] } };
+			BinTriangle (out);
+		} // the clipped polygon is convex, a fan is fine
+		drawStats.trianglesClipped++;
+	}
+
+	static void FrustumPlanes (const Matrix4 &mvp, Vector4 planes[6]) {
+		// frustum planes in model space, straight from the columns of the mvp matrix.
+		// plane . (x, y, z, 1) >= 0 means inside, for left, right, bottom, top, near(z >= 0) and far(z <= w).
+		auto Plane = [&mvp] (int col, float sign, bool plusW) {
+			Vector4 p;
+			float *f = &p.x;
+			for (int i = 0; i < 4; i++) f[i] = mvp.m[i][col] * sign + (plusW ? mvp.m[i][3] : 0.0f);
+			return p;
+		};
+		planes[0] = Plane (0, 1, true), planes[1] = Plane (0, -1, true), planes[2] = Plane (1, 1, true), planes[3] = Plane (1, -1, true);
+		planes[4] = Plane (2, 1, false), planes[5] = Plane (2, -1, true);
+	}
+
+	static bool SphereOutside (const Vector4 planes[6], const Vector4 &center, float radius) {
+		for (int i = 0; i < 6; i++) {
+			const Vector4 &p = planes[i];
+			float len = std::sqrt (p.Dot (p));
+			if (len > 0 && (p.Dot (center) + p.w) < -radius * len) return true;
+		}
+		return false;
+	}
+
+	static bool ModelOutside (const Mesh &model, const Matrix4 &mvp) {
+		Vector4 planes[6];
+		FrustumPlanes (mvp, planes);
+		if (SphereOutside (planes, model.center, model.radius)) return true; // bounding sphere test
+		for (auto &p : planes) {
+			Vector4 corner = { p.x >= 0 ? model.boundsMax.x : model.boundsMin.x, p.y >= 0 ? model.boundsMax.y : model.boundsMin.y, p.z >= 0 ? model.boundsMax.z : model.boundsMin.z };
+			if (p.Dot (corner) + p.w < 0) return true;
+		} // bounding box test, the corner furthest along the plane normal is outside, so is the whole box
+		return false;
+	}
+
+	void CullMeshlets (const Mesh &model, const DrawState &draw, const Matrix4 &worldMat) {
+		// the eye in model space. a meshlet faces away if every point of its bounding sphere sees the triangles from
+		// behind, which is "dot (c - eye, axis) >= cutoff * |c - eye| + radius" for the normal cone (axis, cutoff).
+		// BackFaceCulling () works in view space, the test here agrees with it unless the world matrix mirrors.
+		Matrix4 inv = draw.mvMat;
+		inv.Invert ();
+		Vector4 eye = { inv.m[3][0], inv.m[3][1], inv.m[3][2], 1 }, planes[6];
+		const Matrix4 &w = worldMat;
+		bool mirrored = w.m[0][0] * (w.m[1][1] * w.m[2][2] - w.m[1][2] * w.m[2][1]) - w.m[0][1] * (w.m[1][0] * w.m[2][2] - w.m[1][2] * w.m[2][0]) +
+			w.m[0][2] * (w.m[1][0] * w.m[2][1] - w.m[1][1] * w.m[2][0]) <= 0.0f;
+		FrustumPlanes (draw.mvpMat, planes);
+
+		cache.group.assign ((model.posBuffer.size () + VERTEX_GROUP - 1) / VERTEX_GROUP, 0);
+		cache.meshlets.clear ();
+		for (uint32_t i = 0; i < model.meshlets.size (); i++) {
+			const Meshlet &m = model.meshlets[i];
+			Vector4 d = m.center - eye;
+			if (!mirrored && d.Dot (m.cone) >= m.cone.w * std::sqrt (d.Dot (d)) + m.radius) {
+				drawStats.meshletsBackface++;
+				drawStats.trianglesBackface += m.triangleCount;
+				continue;
+			}
+			if (SphereOutside (planes, m.center, m.radius)) {
+				drawStats.meshletsOutside++;
+				drawStats.trianglesOutside += m.triangleCount;
+				continue;
+			}
+			cache.meshlets.push_back (i);
+			const uint32_t *index = &model.indexBuffer[m.firstIndex];
+			for (uint32_t k = 0; k < m.triangleCount * 3; k++) cache.group[index[k] / VERTEX_GROUP] = 1;
+		}
+		drawStats.meshletsDrawn = cache.meshlets.size ();
+		for (size_t g = 0; g < cache.group.size (); g++)
+			if (cache.group[g]) drawStats.verticesShaded += std::min ((long long)VERTEX_GROUP, (long long)model.posBuffer.size () - (long long)g * VERTEX_GROUP);
+	} // picks the meshlets to draw and marks the vertex groups they use, before any vertex is transformed
 
-		Vector4 weight = { 0, 0, 0, EdgeFunc (v0.pos, v1.pos, v2.pos) };
+	bool ModelOccluded (const Mesh &model, const Matrix4 &mvp) {
+		Rect rect = { width, height, -1, -1 };
+		float nearest = std::numeric_limits<float>::max ();
+		for (int i = 0; i < 8; i++) {
+			Vector4 corner = { i & 1 ? model.boundsMax.x : model.boundsMin.x, i & 2 ? model.boundsMax.y : model.boundsMin.y, i & 4 ? model.boundsMax.z : model.boundsMin.z, 1 };
+			Vector4 c = TransformHomogeneous (corner, mvp);
+			if (c.z < 0.0f) return false; // in front of the near plane, the screen bounds are unknown
+			Vector4 pos = ClipToScreen (c);
+			rect.x0 = std::min (rect.x0, (int)std::floor (pos.x)), rect.y0 = std::min (rect.y0, (int)std::floor (pos.y));
+			rect.x1 = std::max (rect.x1, (int)std::floor (pos.x)), rect.y1 = std::max (rect.y1, (int)std::floor (pos.y));
+			nearest = std::min (nearest, pos.z);
+		}
+		return Occluded ({ std::max (0, rect.x0), std::max (0, rect.y0), std::min (width - 1, rect.x1), std::min (height - 1, rect.y1) }, depthBuffer.Encode (nearest * 0.9999f));
+	} // the screen bounds of the bounding box against the hierarchical z
+
+	bool Occluded (const Rect &rect, uint32_t depth) const {
+		if (rect.x0 > rect.x1 || rect.y0 > rect.y1) return false;
+		for (int ty = rect.y0 / TILE_SIZE; ty <= rect.y1 / TILE_SIZE; ty++) {
+			for (int tx = rect.x0 / TILE_SIZE; tx <= rect.x1 / TILE_SIZE; tx++) {
+				if (depth >= tileMax[tx + ty * tileCols] + depthBias) continue; // the whole tile is nearer
+				int bx1 = std::min (rect.x1, (tx + 1) * TILE_SIZE - 1) / BLOCK_SIZE, by1 = std::min (rect.y1, (ty + 1) * TILE_SIZE - 1) / BLOCK_SIZE;
+				for (int by = std::max (rect.y0, ty * TILE_SIZE) / BLOCK_SIZE; by <= by1; by++)
+					for (int bx = std::max (rect.x0, tx * TILE_SIZE) / BLOCK_SIZE; bx <= bx1; bx++)
+						if (depth < blockMax[bx + by * blockCols] + depthBias) return false;
+			}
+		}
+		return true;
+	} // true if every pixel in rect already holds a depth that a fragment at depth would fail against
+
+	void UpdateHiZ (int tile) {
+		const int PER_TILE = TILE_SIZE / BLOCK_SIZE;
+		int tx = tile % tileCols, ty = tile / tileCols;
+		uint32_t far = 0;
+		for (int by = ty * PER_TILE; by < std::min (blockRows, (ty + 1) * PER_TILE); by++) {
+			for (int bx = tx * PER_TILE; bx < std::min (blockCols, (tx + 1) * PER_TILE); bx++) {
+				int b = bx + by * blockCols;
+				if (blockDirty[b]) {
+					uint32_t lo = 0xffffffff, hi = 0;
+					for (int y = by * BLOCK_SIZE; y < std::min (height, (by + 1) * BLOCK_SIZE); y++) {
+						for (int i = (bx * BLOCK_SIZE + y * width) * samples, end = (std::min (width, (bx + 1) * BLOCK_SIZE) + y * width) * samples; i < end; i++) {
+							uint32_t d = depthBuffer.Load (i);
+							lo = std::min (lo, d), hi = std::max (hi, d);
+						}
+					}
+					blockMin[b] = lo, blockMax[b] = hi, blockDirty[b] = 0;
+				} // every sample counts
+				far = std::max (far, blockMax[b]);
+			}
+		}
+		tileMax[tile] = far;
+	} // rebuild the blocks of a tile that were written since the last update
+
+	uint32_t NearestDepth (const Vertex &v0, const Vertex &v1, const Vertex &v2) const { return depthBuffer.Encode (std::min (v0.pos.z, std::min (v1.pos.z, v2.pos.z)) * 0.9999f); }
+	uint32_t FarthestDepth (const Vertex &v0, const Vertex &v1, const Vertex &v2) const { return depthBuffer.Encode (std::max (v0.pos.z, std::max (v1.pos.z, v2.pos.z)) * 1.0001f); }
+	// bounds for every depth the triangle can produce, with some room for the rounding of the per pixel interpolation
+
+	void BinTriangle (const Triangle &tri) {
+		const Vertex &v0 = tri.v[0], &v1 = tri.v[1], &v2 = tri.v[2];
 		int x0 = std::max (0, (int)std::floor (std::min (v0.pos.x, std::min (v1.pos.x, v2.pos.x))));
 		int y0 = std::max (0, (int)std::floor (std::min (v0.pos.y, std::min (v1.pos.y, v2.pos.y))));
 		int x1 = std::min (width - 1, (int)std::floor (std::max (v0.pos.x, std::max (v1.pos.x, v2.pos.x))));
 		int y1 = std::min (height - 1, (int)std::floor (std::max (v0.pos.y, std::max (v1.pos.y, v2.pos.y))));
-		for (int y = y0; y <= y1; y++) { //       only check for points that are inside the screen
-			for (int x = x0; x <= x1; x++) { //   and inside the triangle bounding box
-				Vertex v = { { x + 0.5f, y + 0.5f, 0 } };
+		if (x0 > x1 || y0 > y1) return; // completely off screen
+		if (occlusionCulling && Occluded ({ x0, y0, x1, y1 }, NearestDepth (v0, v1, v2))) {
+			drawStats.trianglesOccluded++;
+			return;
+		} // hidden behind earlier draws
+
+		int id = (int)triangles.size ();
+		triangles.push_back (tri);
+		for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++) {
+			for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+				auto &bin = tileBins[tx + ty * tileCols];
+				if (bin.empty ()) activeTiles.push_back (tx + ty * tileCols);
+				bin.push_back (id);
+			}
+		}
+	} // the bounding box covers the wireframe edges as well, so one bin list serves both drawing modes
+
+	inline void Ndc2Screen (Vector4 &pos) {
+		pos.x = (pos.x + 1)* 0.5f * width; pos.y = (pos.y + 1)* 0.5f * height; pos.z = pos.w; pos.w = 1.0f / pos.w;
+	} // convert from normalized device coordinate to screen coordinate
 
-				// v is outside the triangle
-				if (TriangleCheck (v0, v1, v2, v, weight)) continue;
+	static inline bool BackFaceCulling (const Vector4 &p0, const Vector4 &p1, const Vector4 &p2) { return (p0.Dot ((p1 - p0).Cross (p2 - p0)) >= 0); }
+
+	static const int BLOCK_SIZE = 8; // must divide TILE_SIZE
+	struct EdgeEquation { float a, b, c, k; }; // E(x, y) = a * x + b * y + c, k turns E into a perspective correct weight
+
+	struct TriangleSetup {
+		EdgeEquation edge[3];
+		float wDx, wDy;
+		Vector4 uvDx, uvDy; // only set up for mipmapped variants
+	};
 
-				// perspective correct interpolation
-				Interpolate (v0, v1, v2, v, weight);
+	// pipeline variants. every combination of these flags is a separate instance of the raster and shading code,
+	// which only interpolates and evaluates what it uses. ShadeVariant () picks one per draw.
+	enum ShadeFlags { SHADE_TEXTURED = 1, SHADE_LIT = 2, SHADE_BILINEAR = 4, SHADE_NEAREST = 8, SHADE_VARIANTS = 16, SHADE_VISIBILITY = 16, SHADE_DEPTH = 32 };
+	static constexpr bool Mipmapped (int shade) { return (shade & SHADE_TEXTURED) && !(shade & (SHADE_BILINEAR | SHADE_NEAREST | SHADE_VISIBILITY | SHADE_DEPTH)); }
 
-				// z test
-				if (v.pos.z >= depthBuffer[x + y * width]) continue;
+	static int ShadeVariant (const Material &material) {
+		int shade = material.kd != 0.0f || material.ks != 0.0f ? SHADE_LIT : 0;
+		if (material.texture) shade |= SHADE_TEXTURED | (material.filter == FILTER_BILINEAR ? SHADE_BILINEAR : material.filter == FILTER_NEAREST ? SHADE_NEAREST : 0);
+		return shade;
+	}
 
-				// pixel shader needs to be run for every fragment of the triangle
-				// and then write the result to frame/depth buffer
-				DrawPoint (x, y, PixelShader (v), v.pos.z);
+	typedef void (Renderer::*FillFunc) (const DrawState &, const Vertex &, const Vertex &, const Vertex &, const Rect &, uint32_t, uint32_t, PixelStats &);
+	struct VariantTable {
+		FillFunc fill[SHADE_VARIANTS], fillSamples[SHADE_VARIANTS];
+		ShadeSpanFunc shade[SHADE_VARIANTS];
+		VariantTable () { Add (std::integral_constant<int, SHADE_VARIANTS - 1> ()); }
+		template <int N> void Add (std::integral_constant<int, N>) {
+			fill[N] = &Renderer::FillTriangle<N>, fillSamples[N] = &Renderer::FillTriangleMultisample<N>, shade[N] = &Renderer::ShadeSpan<N>;
+			Add (std::integral_constant<int, N - 1> ());
+		}
+		void Add (std::integral_constant<int, -1>) {}
+	}; // instantiates every variant, indexed by its flags
+
+	static const VariantTable &Variants () {
+		static const VariantTable table;
+		return table;
+	}
+
+	template <int SHADE> Vector4 PixelShader (const Material &material, const Vector4 &lightViewPos, const Vertex &v, const TriangleSetup &setup, TileLights tile) const {
+		Vector4 color = TextureLookup<SHADE> (material.texture.get (), setup, v);
+		if (!(SHADE & SHADE_LIT)) return color * (light.ambientColor * material.ka);
+		auto ldir = (lightViewPos - v.viewPos).Normalize ();
+		auto lambertian = std::max (0.0f, ldir.Dot (v.normal));
+		auto specular = 0.0f;
+		auto viewDir = (-v.viewPos).Normalize ();
+		if (lambertian > 0) {
+			auto half = (ldir + viewDir).Normalize ();
+			auto angle = std::max (0.0f, half.Dot (v.normal));
+			specular = std::pow (angle, 16.0f);
+		}
+		Vector4 diffuse = light.diffuseColor * lambertian, highlight = light.specularColor * specular;
+
+		// local lights of this tile, each one fades out smoothly at its radius
+		for (int i = 0; i < tile.count; i++) {
+			const ViewLight &l = viewLights[tile.index[i]];
+			Vector4 d = l.pos - v.viewPos;
+			float dist2 = d.Dot (d);
+			if (dist2 >= l.radius2) continue;
+			float invDist = 1.0f / std::sqrt (dist2), falloff = 1.0f - dist2 / l.radius2;
+			Vector4 dir = d * invDist;
+			float lambert = dir.Dot (v.normal);
+			if (lambert <= 0) continue;
+			float attenuation = falloff * falloff, angle = std::max (0.0f, (dir + viewDir).Normalize ().Dot (v.normal));
+			diffuse = diffuse + l.color * (lambert * attenuation);
+			highlight = highlight + l.color * (std::pow (angle, 16.0f) * attenuation);
+		}
+		return (color * (light.ambientColor * material.ka + diffuse * material.kd) + highlight * material.ks);
+	} // blinn-phong shading.
+
+	template <int SHADE> static bool SetupTriangle (const Vertex &v0, const Vertex &v1, const Vertex &v2, TriangleSetup &setup) {
+		float area = EdgeFunc (v0.pos, v1.pos, v2.pos);
+		if (area == 0.0f) return false; // degenerated triangle, covers nothing
+
+		// E(x, y) is linear, so we set up a * x + b * y + c once and the per pixel work is a multiply and an add.
+		// flipping the sign for clockwise triangles means "inside" is always E >= 0.
+		float sign = area > 0.0f ? 1.0f : -1.0f, invArea = sign / area; // pos.w == 1 / pos.z . we did that in Ndc2Screen()
+		EdgeEquation *edge = setup.edge;
+		edge[0] = SetupEdge (v1.pos, v2.pos, sign, v0.pos.w * invArea), edge[1] = SetupEdge (v2.pos, v0.pos, sign, v1.pos.w * invArea), edge[2] = SetupEdge (v0.pos, v1.pos, sign, v2.pos.w * invArea);
+
+		// uv = sum (w * uv) / sum (w) and both sums are linear in x and y, so their gradients are constant per triangle.
+		// d(uv)/dx = (d(sum (w * uv))/dx - uv * d(sum (w))/dx) / sum (w), that is all we need for mip level selection.
+		if (!Mipmapped (SHADE)) return true;
+		setup.wDx = edge[0].a * edge[0].k + edge[1].a * edge[1].k + edge[2].a * edge[2].k, setup.wDy = edge[0].b * edge[0].k + edge[1].b * edge[1].k + edge[2].b * edge[2].k;
+		setup.uvDx = v0.uv * (edge[0].a * edge[0].k) + v1.uv * (edge[1].a * edge[1].k) + v2.uv * (edge[2].a * edge[2].k);
+		setup.uvDy = v0.uv * (edge[0].b * edge[0].k) + v1.uv * (edge[1].b * edge[1].k) + v2.uv * (edge[2].b * edge[2].k);
+		return true;
+	}
+
+	// SHADE_VISIBILITY unset: interpolate, z test, shade and write color/depth.
+	// SHADE_VISIBILITY set: only z test and write depth plus (draw, triangle) id, Resolve() does the rest.
+	// SHADE_DEPTH set: only z test and write depth, for the depth prepass.
+	template <int SHADE> void FillTriangle (const DrawState &draw, const Vertex &v0, const Vertex &v1, const Vertex &v2, const Rect &clip, uint32_t drawId, uint32_t triId, PixelStats &counters) {
+		const bool VISIBILITY = (SHADE & (SHADE_VISIBILITY | SHADE_DEPTH)) != 0;
+		TileLights tile = LightsAt (clip.x0, clip.y0); // clip is one raster tile
+		TriangleSetup setup;
+		if (!SetupTriangle<SHADE> (v0, v1, v2, setup)) return;
+		const EdgeEquation *edge = setup.edge;
+		uint32_t nearest = NearestDepth (v0, v1, v2), farthest = FarthestDepth (v0, v1, v2);
+
+		int x0 = std::max (clip.x0, (int)std::floor (std::min (v0.pos.x, std::min (v1.pos.x, v2.pos.x))));
+		int y0 = std::max (clip.y0, (int)std::floor (std::min (v0.pos.y, std::min (v1.pos.y, v2.pos.y))));
+		int x1 = std::min (clip.x1, (int)std::floor (std::max (v0.pos.x, std::max (v1.pos.x, v2.pos.x))));
+		int y1 = std::min (clip.y1, (int)std::floor (std::max (v0.pos.y, std::max (v1.pos.y, v2.pos.y))));
+		COBRA_STAT (if (x0 <= x1 && y0 <= y1) counters.tested += (long long)(x1 - x0 + 1) * (y1 - y0 + 1));
+		for (int by = y0 & ~(BLOCK_SIZE - 1); by <= y1; by += BLOCK_SIZE) { // only check for points that are inside the clip rect(screen tile)
+			for (int bx = x0 & ~(BLOCK_SIZE - 1); bx <= x1; bx += BLOCK_SIZE) { //   and inside the triangle bounding box
+				int bx0 = std::max (bx, x0), by0 = std::max (by, y0), bx1 = std::min (bx + BLOCK_SIZE - 1, x1), by1 = std::min (by + BLOCK_SIZE - 1, y1);
+
+				// E is monotonic along x and y, so the corners of the block tell whether the block is
+				// completely outside an edge (trivial reject) or completely inside all edges (trivial accept).
+				bool reject = false, accept = true;
+				for (int i = 0; i < 3; i++) {
+					const EdgeEquation &e = edge[i];
+					reject |= EdgeAt (e, e.a >= 0 ? bx1 : bx0, e.b >= 0 ? by1 : by0) < 0;
+					accept &= EdgeAt (e, e.a >= 0 ? bx0 : bx1, e.b >= 0 ? by0 : by1) >= 0;
+				}
+				if (reject) continue;
+
+				// hierarchical z: the block is either completely in front of the triangle, or completely behind it
+				int block = bx / BLOCK_SIZE + by / BLOCK_SIZE * blockCols;
+				if (nearest >= blockMax[block] + depthBias) {
+					COBRA_STAT (counters.blocksOccluded++);
+					continue;
+				}
+				bool nearer = farthest < blockMin[block], written = false;
+
+				unsigned lanes = ((1u << (bx1 - bx0 + 1)) - 1) << (bx0 - bx);
+				for (int y = by0; y <= by1; y++) {
+					float py = y + 0.5f, row[3] = { edge[0].b * py + edge[0].c, edge[1].b * py + edge[1].c, edge[2].b * py + edge[2].c };
+					alignas (32) float e[3][BLOCK_SIZE];
+					unsigned mask = (accept ? EdgeValues<false> (edge, row, bx + 0.5f, e) : EdgeValues<true> (edge, row, bx + 0.5f, e)) & lanes;
+					while (mask) { // an empty span skips the whole row segment
+						int i = LowestBit (mask), x = bx + i;
+						mask &= mask - 1;
+						COBRA_STAT (counters.covered++);
+						COBRA_STAT (if (!heatMap.empty ()) heatMap[x + y * width] += heatMap[x + y * width] < 0xffff);
+
+						// perspective correct interpolation
+						Vertex v = { { x + 0.5f, py, 0 } };
+						Vector4 weight = { e[0][i] * edge[0].k, e[1][i] * edge[1].k, e[2][i] * edge[2].k, 0 };
+						if (VISIBILITY) v.pos.z = 1.0f / (weight.x + weight.y + weight.z);
+						else Interpolate<SHADE> (v0, v1, v2, v, weight);
+
+						// z test
+						uint32_t depth = depthBuffer.Encode (v.pos.z);
+						if (!nearer && depth >= depthBuffer.Load (x + y * width) + depthBias) {
+							COBRA_STAT (counters.depthRejected++);
+							continue;
+						}
+
+						if (VISIBILITY) {
+							depthBuffer.Store (x + y * width, depth);
+							if (SHADE & SHADE_VISIBILITY) idBuffer[x + y * width] = { drawId, triId };
+							written = true;
+							continue;
+						} // the pixel shader runs later, once per visible pixel
+
+						// pixel shader needs to be run for every fragment of the triangle
+						// and then write the result to frame/depth buffer
+						COBRA_STAT (counters.shaded++; counters.textureSamples += draw.material.texture != nullptr);
+						DrawPoint (x, y, PixelShader<SHADE> (draw.material, draw.lightViewPos, v, setup, tile), v.pos.z, clip);
+					}
+				}
+				if (written) blockMin[block] = std::min (blockMin[block], nearest), blockDirty[block] = 1;
 			}
-		} // use edge function to draw triangle.
+		} // walk the bounding box block by block, testing a whole row of a block at once.
 	} // fill triangle with color
 
-	static bool TriangleCheck (const Vertex &v0, const Vertex &v1, const Vertex &v2, Vertex &v, Vector4 &w) {
-		w.x = EdgeFunc (v1.pos, v2.pos, v.pos) * v0.pos.w / w.w; // pos.w == 1 / pos.z . we did that in Ndc2Screen()
-		w.y = EdgeFunc (v2.pos, v0.pos, v.pos) * v1.pos.w / w.w;
-		w.z = EdgeFunc (v0.pos, v1.pos, v.pos) * v2.pos.w / w.w;
-		return (w.x < 0 || w.y < 0 || w.z < 0);
-	} // return true if v is outside the triangle
+	template <int SHADE> void FillTriangleMultisample (const DrawState &draw, const Vertex &v0, const Vertex &v1, const Vertex &v2, const Rect &clip, uint32_t, uint32_t, PixelStats &counters) {
+		TileLights tile = LightsAt (clip.x0, clip.y0);
+		TriangleSetup setup;
+		if (!SetupTriangle<SHADE> (v0, v1, v2, setup)) return;
+		const EdgeEquation *edge = setup.edge;
+		const float (*offset)[2] = SamplePattern (samples);
+		uint32_t nearest = NearestDepth (v0, v1, v2), farthest = FarthestDepth (v0, v1, v2);
+
+		int x0 = std::max (clip.x0, (int)std::floor (std::min (v0.pos.x, std::min (v1.pos.x, v2.pos.x))));
+		int y0 = std::max (clip.y0, (int)std::floor (std::min (v0.pos.y, std::min (v1.pos.y, v2.pos.y))));
+		int x1 = std::min (clip.x1, (int)std::floor (std::max (v0.pos.x, std::max (v1.pos.x, v2.pos.x))));
+		int y1 = std::min (clip.y1, (int)std::floor (std::max (v0.pos.y, std::max (v1.pos.y, v2.pos.y))));
+		COBRA_STAT (if (x0 <= x1 && y0 <= y1) counters.tested += (long long)(x1 - x0 + 1) * (y1 - y0 + 1));
+		for (int by = y0 & ~(BLOCK_SIZE - 1); by <= y1; by += BLOCK_SIZE) {
+			for (int bx = x0 & ~(BLOCK_SIZE - 1); bx <= x1; bx += BLOCK_SIZE) {
+				int bx0 = std::max (bx, x0), by0 = std::max (by, y0), bx1 = std::min (bx + BLOCK_SIZE - 1, x1), by1 = std::min (by + BLOCK_SIZE - 1, y1);
+
+				// same corner tests as FillTriangle (), widened by half a pixel since samples sit anywhere inside the pixel
+				bool reject = false, accept = true;
+				for (int i = 0; i < 3; i++) {
+					const EdgeEquation &e = edge[i];
+					float margin = 0.5f * (std::fabs (e.a) + std::fabs (e.b));
+					reject |= EdgeAt (e, e.a >= 0 ? bx1 : bx0, e.b >= 0 ? by1 : by0) + margin < 0;
+					accept &= EdgeAt (e, e.a >= 0 ? bx0 : bx1, e.b >= 0 ? by0 : by1) - margin >= 0;
+				}
+				if (reject) continue;
+				int block = bx / BLOCK_SIZE + by / BLOCK_SIZE * blockCols;
+				if (nearest >= blockMax[block] + depthBias) {
+					COBRA_STAT (counters.blocksOccluded++);
+					continue;
+				}
+				bool nearer = farthest < blockMin[block], written = false;
+
+				unsigned lanes = ((1u << (bx1 - bx0 + 1)) - 1) << (bx0 - bx);
+				for (int y = by0; y <= by1; y++) {
+					// coverage for each sample, BLOCK_SIZE pixels at a time. cover[s] bit i is sample s of pixel bx + i
+					alignas (32) float e[MAX_SAMPLES][3][BLOCK_SIZE], invZ[MAX_SAMPLES][BLOCK_SIZE];
+					unsigned cover[MAX_SAMPLES], any = 0;
+					for (int s = 0; s < samples; s++) {
+						float py = y + 0.5f + offset[s][1], row[3] = { edge[0].b * py + edge[0].c, edge[1].b * py + edge[1].c, edge[2].b * py + edge[2].c };
+						cover[s] = (accept ? EdgeValues<false> (edge, row, bx + 0.5f + offset[s][0], e[s]) : EdgeValues<true> (edge, row, bx + 0.5f + offset[s][0], e[s])) & lanes;
+						any |= cover[s];
+						if (!cover[s]) continue;
+						for (int j = 0; j < BLOCK_SIZE; j++) invZ[s][j] = e[s][0][j] * edge[0].k + e[s][1][j] * edge[1].k + e[s][2][j] * edge[2].k;
+					}
+					while (any) {
+						int i = LowestBit (any), x = bx + i, pixel = (x + y * width) * samples;
+						any &= any - 1;
+						COBRA_STAT (counters.covered++);
+						COBRA_STAT (if (!heatMap.empty ()) heatMap[x + y * width] += heatMap[x + y * width] < 0xffff);
+
+						// z test every covered sample
+						uint32_t depth[MAX_SAMPLES];
+						unsigned pass = 0;
+						for (int s = 0; s < samples; s++) {
+							if (!(cover[s] >> i & 1)) continue;
+							depth[s] = depthBuffer.Encode (1.0f / invZ[s][i]);
+							if (nearer || depth[s] < depthBuffer.Load (pixel + s) + depthBias) pass |= 1u << s;
+						}
+						if (!pass) {
+							COBRA_STAT (counters.depthRejected++);
+							continue;
+						}
+						written = true;
+						if (SHADE & SHADE_DEPTH) {
+							for (int s = 0; s < samples; s++)
+								if (pass >> s & 1) depthBuffer.Store (pixel + s, depth[s]);
+							continue;
+						} // depth prepass
+
+						// shade once at the pixel center, even if the center itself is outside the triangle
+						float px = x + 0.5f, py = y + 0.5f;
+						Vertex v = { { px, py, 0 } };
+						Vector4 weight = { (edge[0].a * px + (edge[0].b * py + edge[0].c)) * edge[0].k, (edge[1].a * px + (edge[1].b * py + edge[1].c)) * edge[1].k,
+							(edge[2].a * px + (edge[2].b * py + edge[2].c)) * edge[2].k, 0 };
+						Interpolate<SHADE> (v0, v1, v2, v, weight);
+						COBRA_STAT (counters.shaded++; counters.textureSamples += draw.material.texture != nullptr);
+						Vector4 color = PixelShader<SHADE> (draw.material, draw.lightViewPos, v, setup, tile);
+						for (int s = 0; s < samples; s++) {
+							if (!(pass >> s & 1)) continue;
+							sampleBuffer.Store (pixel + s, color);
+							depthBuffer.Store (pixel + s, depth[s]);
+						}
+					}
+				}
+				if (written) blockMin[block] = std::min (blockMin[block], nearest), blockDirty[block] = 1;
+			}
+		}
+	} // FillTriangle () with per sample coverage and depth, forward mode only
+
+	void ResolveSamples () {
+		float scale = 1.0f / samples;
+		pool.ParallelFor (height, [this, scale] (int y, int) {
+			if (sampleBuffer.format == COLOR_RGBA8) {
+				const unsigned char *in = &sampleBuffer.data[(size_t)y * width * samples * 4];
+				unsigned char *out = &frameBuffer.data[(size_t)y * width * 4];
+				for (int x = 0; x < width; x++, in += samples * 4) {
+#if defined(COBRA_SSE2)
+					__m128i zero = _mm_setzero_si128 (), sum = zero;
+					for (int s = 0; s < samples; s += 4) {
+						__m128i v = samples == 2 ? _mm_loadl_epi64 ((const __m128i *)(in + s * 4)) : _mm_loadu_si128 ((const __m128i *)(in + s * 4));
+						sum = _mm_add_epi16 (sum, _mm_add_epi16 (_mm_unpacklo_epi8 (v, zero), _mm_unpackhi_epi8 (v, zero)));
+					} // four samples at a time as 16 bit lanes
+					sum = _mm_add_epi16 (sum, _mm_srli_si128 (sum, 8));
+					sum = _mm_srli_epi16 (_mm_add_epi16 (sum, _mm_set1_epi16 ((short)(samples / 2))), samples == 8 ? 3 : samples == 4 ? 2 : 1);
+					int pixel = _mm_cvtsi128_si32 (_mm_packus_epi16 (sum, zero));
+					memcpy (out + x * 4, &pixel, 4);
+#else
+					for (int c = 0; c < 4; c++) {
+						int sum = 0;
+						for (int s = 0; s < samples; s++) sum += in[s * 4 + c];
+						out[x * 4 + c] = (unsigned char)((sum + samples / 2) / samples);
+					}
+#endif
+				}
+				return;
+			} // integer average, a pixel whose samples are all the same keeps its exact value
+			for (int x = 0; x < width; x++) {
+				int pixel = (x + y * width) * samples;
+				Vector4 sum = sampleBuffer.Load (pixel);
+				for (int s = 1; s < samples; s++) sum = sum + sampleBuffer.Load (pixel + s);
+				frameBuffer.Store (x + y * width, sum * scale);
+			}
+		});
+	} // box filter, every sample of a pixel has the same weight
+
+	void Resolve () {
+		if (samples > 1) {
+			auto stageStart = std::chrono::steady_clock::now ();
+			ResolveSamples ();
+			stats.shadeTime += Elapsed (stageStart);
+		}
+		if (!deferred) return;
+		auto stageStart = std::chrono::steady_clock::now ();
+		threadStats.assign (pool.Size (), PixelStats ());
+		pool.ParallelFor (height, [this] (int y, int thread) {
+			for (int x = 0; x < width;) {
+				uint32_t draw = idBuffer[x + y * width].draw;
+				int end = x + 1;
+				while (end < width && idBuffer[end + y * width].draw == draw) end++;
+				if (draw < WIREFRAME_DRAW) (this->*drawRecords[draw].shade) (drawRecords[draw], y, x, end, threadStats[thread]); // background or wireframe is final already
+				x = end;
+			} // one variant dispatch per run of pixels from the same draw
+			std::fill (idBuffer.begin () + y * width, idBuffer.begin () + (y + 1) * width, VisibilityId { NO_DRAW, 0 });
+		});
+		if (!drawRecords.empty () && drawRecords.back ().triangles.capacity () > triangles.capacity ()) triangles.swap (drawRecords.back ().triangles); // keep its storage for the next frame
+		drawRecords.clear ();
+		stats.shadeTime += Elapsed (stageStart);
+		MergePixelStats (stats);
+	} // deferred shading pass, shades every visible pixel exactly once, rows are independent so they run in parallel
+
+	template <int SHADE> void ShadeSpan (const DrawRecord &draw, int y, int x0, int x1, PixelStats &counters) {
+		uint32_t last = NO_DRAW;
+		TriangleSetup setup = TriangleSetup ();
+		bool valid = false;
+		for (int x = x0; x < x1; x++) {
+			uint32_t triangle = idBuffer[x + y * width].triangle;
+			const Vertex *tri = draw.triangles[triangle].v;
+			if (triangle != last) valid = SetupTriangle<SHADE> (tri[0], tri[1], tri[2], setup), last = triangle;
+			if (!valid) continue;
+
+			// reconstruct the perspective correct weights exactly like FillTriangle did
+			const EdgeEquation *e = setup.edge;
+			Vertex v = { { x + 0.5f, y + 0.5f, 0 } };
+			Vector4 weight = { EdgeAt (e[0], x, y) * e[0].k, EdgeAt (e[1], x, y) * e[1].k, EdgeAt (e[2], x, y) * e[2].k, 0 };
+			Interpolate<SHADE> (tri[0], tri[1], tri[2], v, weight);
+			COBRA_STAT (counters.shaded++; counters.textureSamples += (SHADE & SHADE_TEXTURED) != 0);
+			frameBuffer.Store (x + y * width, PixelShader<SHADE> (draw.material, draw.lightViewPos, v, setup, LightsAt (x, y)));
+		}
+	} // shade pixels [x0, x1) of row y, they all belong to one draw
+
+	void MergePixelStats (RenderStats &into) {
+		for (auto &counters : threadStats) {
+			into.blocksOccluded += counters.blocksOccluded, into.pixelsTested += counters.tested, into.pixelsCovered += counters.covered, into.pixelsDepthRejected += counters.depthRejected;
+			into.pixelsShaded += counters.shaded, into.textureSamples += counters.textureSamples;
+		}
+	} // the threads count privately, the totals are summed once per pass
+
+	static double Elapsed (std::chrono::steady_clock::time_point &since) {
+		auto now = std::chrono::steady_clock::now ();
+		double seconds = std::chrono::duration<double> (now - since).count ();
+		since = now;
+		return seconds;
+	} // seconds since the last call, restarts the clock
+
+	static inline EdgeEquation SetupEdge (const Vector4 &p0, const Vector4 &p1, float sign, float k) {
+		return{ (p1.y - p0.y) * sign, (p0.x - p1.x) * sign, (p0.y * (p1.x - p0.x) - p0.x * (p1.y - p0.y)) * sign, k };
+	} // same as EdgeFunc (p0, p1, p), with p factored out
+
+	static inline float EdgeAt (const EdgeEquation &e, int x, int y) {
+		return e.a * (x + 0.5f) + (e.b * (y + 0.5f) + e.c);
+	} // must round exactly like EdgeValues(), otherwise block tests and pixel tests could disagree
+
+	template <bool TEST> static inline unsigned EdgeValues (const EdgeEquation *edge, const float *row, float px, float (*out)[BLOCK_SIZE]) {
+		unsigned mask = (1u << BLOCK_SIZE) - 1;
+#if defined(COBRA_AVX2)
+		__m256 x = _mm256_add_ps (_mm256_set1_ps (px), _mm256_setr_ps (0, 1, 2, 3, 4, 5, 6, 7));
+		for (int i = 0; i < 3; i++) {
+			__m256 e = _mm256_add_ps (_mm256_mul_ps (_mm256_set1_ps (edge[i].a), x), _mm256_set1_ps (row[i]));
+			_mm256_store_ps (out[i], e);
+			if (TEST) mask &= (unsigned)_mm256_movemask_ps (_mm256_cmp_ps (e, _mm256_setzero_ps (), _CMP_GE_OQ));
+		}
+#elif defined(COBRA_SSE2)
+		__m128 x0 = _mm_add_ps (_mm_set1_ps (px), _mm_setr_ps (0, 1, 2, 3)), x1 = _mm_add_ps (x0, _mm_set1_ps (4));
+		for (int i = 0; i < 3; i++) {
+			__m128 a = _mm_set1_ps (edge[i].a), r = _mm_set1_ps (row[i]);
+			__m128 e0 = _mm_add_ps (_mm_mul_ps (a, x0), r), e1 = _mm_add_ps (_mm_mul_ps (a, x1), r);
+			_mm_store_ps (out[i], e0); _mm_store_ps (out[i] + 4, e1);
+			if (TEST) mask &= (unsigned)(_mm_movemask_ps (_mm_cmpge_ps (e0, _mm_setzero_ps ())) | (_mm_movemask_ps (_mm_cmpge_ps (e1, _mm_setzero_ps ())) << 4));
+		}
+#else
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < BLOCK_SIZE; j++) {
+				out[i][j] = edge[i].a * (px + j) + row[i];
+				if (TEST && out[i][j] < 0) mask &= ~(1u << j);
+			}
+		}
+#endif
+		return mask;
+	} // evaluate all three edges for a row of BLOCK_SIZE pixels, bit i of the result is set if pixel i is inside
+
+	static inline int LowestBit (unsigned mask) {
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanForward (&i, mask);
+		return (int)i;
+#else
+		return __builtin_ctz (mask);
+#endif
+	}
 
 	static inline float EdgeFunc (const Vector4 &p0, const Vector4 &p1, const Vector4 &p2) {
 		return ((p2.x - p0.x) * (p1.y - p0.y) - (p2.y - p0.y) * (p1.x - p0.x));
 	} // note that the result of edge function could be represent as area as well.
 
-	static inline void Interpolate (const Vertex &v0, const Vertex &v1, const Vertex &v2, Vertex &v, const Vector4 &w) {
-		v.pos.z = 1.0f / (w.x + w.y + w.z); // keep in maind that in TriangleCheck() we already done the (w = w * 1/z) part
-		v.viewPos = (v0.viewPos * w.x + v1.viewPos * w.y + v2.viewPos * w.z) * v.pos.z;
-		v.normal = (v0.normal * w.x + v1.normal * w.y + v2.normal * w.z) * v.pos.z;
-		v.color = (v0.color * w.x + v1.color * w.y + v2.color * w.z) * v.pos.z;
-		v.uv = (v0.uv * w.x + v1.uv * w.y + v2.uv * w.z) * v.pos.z;
-	} // yes we interpolate all variables, no matter they are going to be used or not.
-
-	static inline Vector4 TextureLookup (const Texture &texture, float s, float t) {
-		Vector4 color = { 0.87f, 0.87f, 0.87f, 0 }; // default color
-		if (!texture.data.empty ()) {
-			s = Saturate (s), t = Saturate (t); // texture wrap
-			color = BilinearFiltering (texture, s * (texture.width - 1), t * (texture.height - 1));
+	template <int SHADE> static inline void Interpolate (const Vertex &v0, const Vertex &v1, const Vertex &v2, Vertex &v, const Vector4 &w) {
+		v.pos.z = 1.0f / (w.x + w.y + w.z); // keep in maind that in FillTriangle() we already done the (w = w * 1/z) part
+		if (SHADE & SHADE_LIT) {
+			v.viewPos = (v0.viewPos * w.x + v1.viewPos * w.y + v2.viewPos * w.z) * v.pos.z;
+			v.normal = (v0.normal * w.x + v1.normal * w.y + v2.normal * w.z) * v.pos.z;
 		}
-		return color;
-	} // get pixel color from texture
+		if (SHADE & SHADE_TEXTURED) v.uv = (v0.uv * w.x + v1.uv * w.y + v2.uv * w.z) * v.pos.z;
+	} // only the attributes the variant is going to read
+
+	template <int SHADE> static inline Vector4 TextureLookup (const Texture *texture, const TriangleSetup &setup, const Vertex &v) {
+		if (!(SHADE & SHADE_TEXTURED)) return{ 0.87f, 0.87f, 0.87f, 0 }; // default color
+		float s = Saturate (v.uv.x), t = Saturate (v.uv.y); // texture wrap
+		const Texture::Level &base = texture->levels[0];
+		if (SHADE & SHADE_NEAREST) return Texel (base, std::min (base.width - 1, (int)(s * base.width)), std::min (base.height - 1, (int)(t * base.height)));
+		if (SHADE & SHADE_BILINEAR) return BilinearFiltering (base, s, t);
+		float lod = TextureLod (*texture, (setup.uvDx - v.uv * setup.wDx) * v.pos.z, (setup.uvDy - v.uv * setup.wDy) * v.pos.z);
+		int top = (int)texture->levels.size () - 1;
+		if (lod <= 0.0f) return BilinearFiltering (texture->levels[0], s, t); // magnified
+		if (lod >= top) return BilinearFiltering (texture->levels[top], s, t);
+		int level = (int)lod;
+		float f = lod - level;
+		return BilinearFiltering (texture->levels[level], s, t) * (1.0f - f) + BilinearFiltering (texture->levels[level + 1], s, t) * f;
+	} // get pixel color from texture, by default trilinear filtering between the two nearest mip levels
+
+	static inline float TextureLod (const Texture &texture, const Vector4 &uvDx, const Vector4 &uvDy) {
+		float w = (float)texture.levels[0].width, h = (float)texture.levels[0].height;
+		float lx = uvDx.x * uvDx.x * w * w + uvDx.y * uvDx.y * h * h, ly = uvDy.x * uvDy.x * w * w + uvDy.y * uvDy.y * h * h;
+		return std::max (0.0f, 0.5f * std::log2 (std::max (lx, ly)));
+	} // mip level from the texel footprint of one pixel step in x and y
 
 	static inline float Saturate (float n) {
 		return std::min (1.0f, std::max (0.0f, n));
 	} // clamp n to range [0.0, 1.0]
 
-	static inline Vector4 BilinearFiltering (const Texture &texture, float s, float t) {
-		if (s <= 0.5f || s >= texture.smax) return LinearFilteringV (texture, s, t);
-		if (t <= 0.5f || t >= texture.tmax) return LinearFilteringH (texture, s, t);
-		float supper = s + 0.5f, fs = std::floor (supper), ws = supper - fs, tupper = t + 0.5f, ts = std::floor (tupper), wt = tupper - ts;
-		return (NearestNeighbor (texture, fs, ts) * ws * wt +
-			NearestNeighbor (texture, fs, ts - 1.0f) * ws * (1.0f - wt) +
-			NearestNeighbor (texture, fs - 1.0f, ts) * (1.0f - ws) * wt +
-			NearestNeighbor (texture, fs - 1.0f, ts - 1.0f) * (1.0f - ws) * (1.0f - wt));
-	} // Texture filtering : Bilinear filtering
-
-	static inline Vector4 LinearFilteringH (const Texture &texture, float s, float t) {
-		if (s <= 0.5f || s >= texture.smax) return NearestNeighbor (texture, s, t);
-		float supper = s + 0.5f, fs = std::floor (supper), ws = supper - fs;
-		return (NearestNeighbor (texture, fs, t) * ws + NearestNeighbor (texture, fs - 1.0f, t) * (1.0f - ws));
-	} // Texture filtering : horizontal linear filtering
-
-	static inline Vector4 LinearFilteringV (const Texture &texture, float s, float t) {
-		if (t <= 0.5f || t >= texture.tmax) return NearestNeighbor (texture, s, t);
-		float tupper = t + 0.5f, ts = std::floor (tupper), wt = tupper - ts;
-		return (NearestNeighbor (texture, s, ts) * wt + NearestNeighbor (texture, s, ts - 1.0f) * (1.0f - wt));
-	} // texture filtering : vertical linear filtering
-
-	static inline Vector4 NearestNeighbor (const Texture &texture, float s, float t) {
-		return texture.data[(int)std::round (s) + (int)std::round (t) * texture.width];
-	} // texture filtering : nearest-neighbor interpolation
-
-	void DrawTriangle (const Vertex &v0, const Vertex &v1, const Vertex &v2, const Vector4 &color) {
-		DrawLine (v0.pos, v1.pos, color); DrawLine (v1.pos, v2.pos, color); DrawLine (v0.pos, v2.pos, color);
+	static inline Vector4 BilinearFiltering (const Texture::Level &level, float s, float t) {
+		float fs = s * level.width - 0.5f, ft = t * level.height - 0.5f, s0 = std::floor (fs), t0 = std::floor (ft), ws = fs - s0, wt = ft - t0;
+		int x0 = std::max (0, (int)s0), y0 = std::max (0, (int)t0), x1 = std::min (level.width - 1, (int)s0 + 1), y1 = std::min (level.height - 1, (int)t0 + 1);
+		return ((Texel (level, x0, y0) * (1.0f - ws) + Texel (level, x1, y0) * ws) * (1.0f - wt) +
+			(Texel (level, x0, y1) * (1.0f - ws) + Texel (level, x1, y1) * ws) * wt);
+	} // Texture filtering : Bilinear filtering, clamp to edge
+
+	static inline Vector4 Texel (const Texture::Level &level, int x, int y) {
+		uint32_t c = level.data[((y >> 2) * level.tileCols + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)];
+		const float n = 1.0f / 255.0f;
+		return{ (c & 0xff) * n, ((c >> 8) & 0xff) * n, ((c >> 16) & 0xff) * n, (c >> 24) * n };
+	} // fetch one texel from the 4x4 tiled layout
+
+	void DrawTriangle (const Vertex &v0, const Vertex &v1, const Vertex &v2, const Vector4 &color, const Rect &clip) {
+		DrawLine (v0.pos, v1.pos, color, clip); DrawLine (v1.pos, v2.pos, color, clip); DrawLine (v0.pos, v2.pos, color, clip);
 	} // draw the edges of a triangle
 
-	void DrawLine (const Vector4 &p0, const Vector4 &p1, const Vector4 &color) {
+	void DrawLine (const Vector4 &p0, const Vector4 &p1, const Vector4 &color, const Rect &clip) {
 		int x0 = (int)std::floor (p0.x), x1 = (int)std::floor (p1.x), y0 = (int)std::floor (p0.y), y1 = (int)std::floor (p1.y);
 		if (abs (x1 - x0) >= abs (y1 - y0)) {
 			if (x0 > x1) { std::swap (x0, x1); std::swap (y0, y1); }
-			DrawLineInternal (x0, y0, x1, y1, color, false);
+			DrawLineInternal (x0, y0, x1, y1, color, false, clip);
 		} else {
 			if (y0 > y1) { std::swap (x0, x1); std::swap (y0, y1); }
-			DrawLineInternal (y0, x0, y1, x1, color, true);
+			DrawLineInternal (y0, x0, y1, x1, color, true, clip);
 		}
 	} // bresenham line algorithm
-	void DrawLineInternal (int x0, int y0, int x1, int y1, const Vector4 &color, bool steep) {
+	void DrawLineInternal (int x0, int y0, int x1, int y1, const Vector4 &color, bool steep, const Rect &clip) {
+		int xmax = std::min (x1, steep ? clip.y1 : clip.x1); // nothing to draw once we walk past the clip rect
 		if (y0 == y1) {
-			for (int x = x0, y = y0; x <= x1; x++)
-				steep ? DrawPoint (y, x, color, 0) : DrawPoint (x, y, color, 0);
+			for (int x = x0, y = y0; x <= xmax; x++)
+				steep ? DrawPoint (y, x, color, 0, clip) : DrawPoint (x, y, color, 0, clip);
 			return;
 		}
 		int dx = x1 - x0, dy = abs (y1 - y0), ystep = dy / (y1 - y0), delta = dy - dx, y = y0;
-		for (int x = x0; x <= x1; x++, delta += dy) {
-			steep ? DrawPoint (y, x, color, 0) : DrawPoint (x, y, color, 0);
+		for (int x = x0; x <= xmax; x++, delta += dy) {
+			steep ? DrawPoint (y, x, color, 0, clip) : DrawPoint (x, y, color, 0, clip);
 			if (delta >= 0) {
 				y += ystep;
 				delta -= dx;
@@ -448,34 +2461,258 @@ struct Renderer {
 		}
 	} // still bresenham line algorithm
 
-	void DrawPoint (int x, int y, const Vector4 &color, float z) {
-		if (x >= 0 && x < width && y >= 0 && y < height) {
-			frameBuffer[x + y * width] = color; // write frame buffer
-			depthBuffer[x + y * width] = z; // write z buffer
+	void DrawPoint (int x, int y, const Vector4 &color, float z, const Rect &clip) {
+		if (x >= clip.x0 && x <= clip.x1 && y >= clip.y0 && y <= clip.y1) {
+			uint32_t depth = depthBuffer.Encode (z);
+			int block = x / BLOCK_SIZE + y / BLOCK_SIZE * blockCols;
+			blockMin[block] = std::min (blockMin[block], depth), blockDirty[block] = 1; // keep the hierarchical z conservative
+			if (samples > 1) {
+				for (int s = 0, pixel = (x + y * width) * samples; s < samples; s++) sampleBuffer.Store (pixel + s, color), depthBuffer.Store (pixel + s, depth);
+				return;
+			} // lines cover whole pixels
+			frameBuffer.Store (x + y * width, color); // write frame buffer
+			depthBuffer.Store (x + y * width, depth); // write z buffer
+			if (deferred) idBuffer[x + y * width] = { WIREFRAME_DRAW, 0 }; // nothing left to shade here
 		}
 	} // need to check the range everytime, a little bit waste ha?
 };
 
-int main () {
+// renders many independent scenes at once. every worker thread owns a single threaded Renderer, so the jobs share
+// nothing but the read-only meshes and textures. Submit () deals the jobs round robin onto per worker queues, a worker
+// takes from the front of its own queue and, once that is empty, steals from the back of the others. scenes cost
+// very different amounts of time, stealing keeps every core busy until the last one is done.
+struct BatchRenderer {
+	struct Result { std::string output; bool saved; double latency, render; }; // seconds, latency counts from Submit () to the written file
+	struct Job { Scene scene; std::chrono::steady_clock::time_point submitted; };
+	struct Worker { std::mutex mutex; std::deque<Job> jobs; }; // allocated one by one, so the queues do not share cache lines
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	std::mutex mutex; // guards everything below
+	std::condition_variable workCond, doneCond;
+	std::vector<Result> results;
+	int queued = 0, pending = 0, next = 0; // pushed but not taken yet(may dip below 0 for a moment), submitted but not finished
+	bool quit = false;
+
+	explicit BatchRenderer (int n = 0) {
+		if (n <= 0) n = std::max (1, (int)std::thread::hardware_concurrency ());
+		for (int i = 0; i < n; i++) workers.emplace_back (new Worker ());
+		for (int i = 0; i < n; i++) threads.emplace_back (&BatchRenderer::WorkerLoop, this, i);
+	}
+	~BatchRenderer () {
+		{ std::lock_guard<std::mutex> lock (mutex); quit = true; }
+		workCond.notify_all ();
+		for (auto &t : threads) t.join ();
+	} // jobs that have not started are dropped
+	BatchRenderer (const BatchRenderer &) = delete;
+	BatchRenderer &operator= (const BatchRenderer &) = delete;
+
+	int Size () const { return (int)workers.size (); }
+
+	void Submit (Scene scene) {
+		int target;
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			target = next++ % Size ();
+			pending++; // before the job is visible, so Wait () cannot miss it
+		}
+		{
+			std::lock_guard<std::mutex> lock (workers[target]->mutex);
+			workers[target]->jobs.push_back ({ std::move (scene), std::chrono::steady_clock::now () });
+		}
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			queued++;
+		}
+		workCond.notify_one ();
+	} // the scene is rendered and saved to scene.output, may be called while jobs are running
+
+	std::vector<Result> Wait () {
+		std::unique_lock<std::mutex> lock (mutex);
+		doneCond.wait (lock, [this] { return pending == 0; });
+		std::vector<Result> done;
+		done.swap (results);
+		return done;
+	} // blocks until every submitted scene is done, returns their results in the order they finished
+
+	bool Take (int self, Job &job) {
+		for (int i = 0; i < Size (); i++) {
+			Worker &w = *workers[(self + i) % Size ()];
+			{
+				std::lock_guard<std::mutex> lock (w.mutex);
+				if (w.jobs.empty ()) continue;
+				if (i == 0) job = std::move (w.jobs.front ()), w.jobs.pop_front ();
+				else job = std::move (w.jobs.back ()), w.jobs.pop_back ();
+			}
+			std::lock_guard<std::mutex> lock (mutex);
+			queued--;
+			return true;
+		}
+		return false;
+	} // own queue first, then steal from the neighbours
+
+	void WorkerLoop (int self) {
+		std::unique_ptr<Renderer> renderer;
+		for (;;) {
+			Job job;
+			if (!Take (self, job)) {
+				std::unique_lock<std::mutex> lock (mutex);
+				workCond.wait (lock, [this] { return quit || queued > 0; });
+				if (quit) return;
+				continue; // someone else may get there first, then this worker looks again
+			} // a job only counts as taken once it has left its queue, nothing is claimed ahead
+
+			auto start = std::chrono::steady_clock::now ();
+			const Scene &scene = job.scene;
+			if (!renderer || renderer->width != scene.width || renderer->height != scene.height)
+				renderer.reset (new Renderer (scene.width, scene.height, COLOR_RGBA8, DEPTH_32F, 1)); // the batch is parallel across jobs, not inside them
+			if (renderer->samples != scene.samples) renderer->SetSamples (scene.samples);
+			renderer->Clear ();
+			renderer->SetScene (scene);
+			renderer->DrawScene (scene);
+			renderer->Resolve ();
+			bool saved = SaveImage (renderer->frameBuffer, scene.output);
+			auto end = std::chrono::steady_clock::now ();
+
+			Result result = { scene.output, saved, std::chrono::duration<double> (end - job.submitted).count (), std::chrono::duration<double> (end - start).count () };
+			job = Job (); // let go of the models before the caller can see the job done
+			{
+				std::lock_guard<std::mutex> lock (mutex);
+				results.push_back (result);
+				pending--;
+			}
+			doneCond.notify_all ();
+		}
+	}
+
+	static double Percentile (std::vector<double> values, double p) {
+		if (values.empty ()) return 0;
+		std::sort (values.begin (), values.end ());
+		size_t rank = (size_t)std::ceil (p / 100.0 * values.size ());
+		return values[std::min (values.size (), std::max ((size_t)1, rank)) - 1];
+	} // nearest rank, p in [0, 100]
+};
+
+#ifndef COBRA_NO_MAIN // cobra_bench includes this file for the renderer only
+int main (int argc, char *argv[]) {
 	// renderer setup
 	const int WIDTH = 1024, HEIGHT = 768;
-	Renderer renderer (WIDTH, HEIGHT);
+	ColorFormat colorFormat = COLOR_RGBA8;
+	DepthFormat depthFormat = DEPTH_32F;
+	std::string output = "screenshot.bmp", heatMap, batch;
+	bool deferred = false, printStats = false, prepass = false;
+	int threads = 0, frames = 0, buffers = 2, lightCount = 0, samples = 1;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp (argv[i], "-deferred")) deferred = true; // shade once per visible pixel
+		else if (!strcmp (argv[i], "-rgba16f")) colorFormat = COLOR_RGBA16F;
+		else if (!strcmp (argv[i], "-rgba32f")) colorFormat = COLOR_RGBA32F;
+		else if (!strcmp (argv[i], "-depth16")) depthFormat = DEPTH_16;
+		else if (!strcmp (argv[i], "-depth24")) depthFormat = DEPTH_24;
+		else if (!strcmp (argv[i], "-o") && i + 1 < argc) output = argv[++i]; // .bmp, .ppm or .png
+		else if (!strcmp (argv[i], "-frames") && i + 1 < argc) frames = atoi (argv[++i]); // render a turntable instead of one image
+		else if (!strcmp (argv[i], "-buffers") && i + 1 < argc) buffers = atoi (argv[++i]);
+		else if (!strcmp (argv[i], "-stats")) printStats = true;
+		else if (!strcmp (argv[i], "-prepass")) prepass = true; // depth only pass over the solid models first
+		else if (!strcmp (argv[i], "-msaa") && i + 1 < argc) samples = atoi (argv[++i]); // 2, 4 or 8 samples per pixel
+		else if (!strcmp (argv[i], "-lights") && i + 1 < argc) lightCount = atoi (argv[++i]); // scatter local lights over the scene
+		else if (!strcmp (argv[i], "-heatmap") && i + 1 < argc) heatMap = argv[++i]; // overdraw image, needs COBRA_STATS
+		else if (!strcmp (argv[i], "-batch") && i + 1 < argc) batch = argv[++i]; // render every scene of a scene file
+		else threads = atoi (argv[i]); // "cobra 8" rasterizes with 8 threads
+	}
+
+	if (!batch.empty ()) {
+		// "cobra 8 -batch scenes.txt" renders the scenes on 8 threads, one scene per thread at a time
+		auto start = std::chrono::steady_clock::now ();
+		std::vector<Scene> scenes;
+		if (!LoadScenes (batch, scenes)) {
+			printf ("cannot load %s\n", batch.c_str ());
+			return 1;
+		}
+		double load = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+		start = std::chrono::steady_clock::now ();
+		BatchRenderer renderer (threads);
+		for (auto &scene : scenes) renderer.Submit (std::move (scene));
+		scenes.clear ();
+		std::vector<BatchRenderer::Result> results = renderer.Wait ();
+		double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
 
-	renderer.SetFrustum ((float)M_PI_2, (float)WIDTH / (float)HEIGHT, 0.1f, 1000.0f);
-	renderer.SetCamera ({ 0.0f, 3.0f, 5.0f }, { 0.0f, 0.0f, 0.0f });
-	renderer.SetLight ({ -10.0f, 30.0f, 30.0f }, { 0.5f, 0.0f, 0.0f, 0 }, { 0.8f, 0.8f, 0.8f, 0 }, { 0.5f, 0.5f, 0.5f, 0 });
+		std::vector<double> latency, render;
+		int failed = 0;
+		for (auto &r : results) {
+			latency.push_back (r.latency * 1e3), render.push_back (r.render * 1e3);
+			if (!r.saved) printf ("%s: write failed\n", r.output.c_str ()), failed++;
+		}
+		printf ("%zu scenes on %d threads in %.2f s(load %.2f s), %.1f scenes/s\n", results.size (), renderer.Size (), seconds, load, results.size () / seconds);
+		printf ("latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", BatchRenderer::Percentile (latency, 50),
+			BatchRenderer::Percentile (latency, 90), BatchRenderer::Percentile (latency, 99), BatchRenderer::Percentile (latency, 100));
+		printf ("render: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", BatchRenderer::Percentile (render, 50),
+			BatchRenderer::Percentile (render, 90), BatchRenderer::Percentile (render, 99), BatchRenderer::Percentile (render, 100));
+		return failed ? 1 : 0;
+	} // latency includes the time a scene waited in the queue, render is the time a worker spent on it
+	Renderer renderer (WIDTH, HEIGHT, colorFormat, depthFormat);
+	if (deferred) renderer.SetDeferred (true);
+	else if (samples > 1) renderer.SetSamples (samples);
+	if (threads > 0) renderer.SetThreadCount (threads);
+	if (!heatMap.empty ()) renderer.SetHeatMap (true);
+
+	// the default scene: camera at (0, 3, 5) looking at the origin, one main light and optionally some local lights
+	Scene scene;
+	scene.width = WIDTH, scene.height = HEIGHT, scene.prepass = prepass, scene.output = output;
+	uint32_t seed = 1;
+	auto random = [&] { seed = seed * 1664525u + 1013904223u; return (seed >> 8) * (1.0f / 16777216.0f); }; // same lights on every run
+	for (int i = 0; i < lightCount; i++) scene.lights.push_back ({ { random () * 10 - 5, random () * 3, random () * 8 - 5, 1 }, { random (), random (), random (), 0 }, 1.5f });
 
 	// Model (filepath, position, material)
-	Model sphere ("res/sphere", { 2.5f, 0.5f, 1.5f }, { 0.1f, 1.0f, 0.5f });
-	renderer.DrawModel (sphere, true, false);
-	Model bunny ("res/bunny", { 0.0f, 0.0f, 0.0f }, { 0.1f, 0.8f, 0.7f });
-	renderer.DrawModel (bunny, true, false);
-	Model cube ("res/cube", { -2.0f, 0.0f, 2.0f }, { 0.3f, 0.8f, 0.8f });
-	renderer.DrawModel (cube, true, false);
-	Model cubeFrame ("res/cube", { 4.0f, 1.8f, -2.2f }, { 0.5f, 0.8f, 0.8f });
-	renderer.DrawModel (cubeFrame, false, true);
-
-	// save the frame buffer to a bmp file
-	SaveBmp (renderer.frameBuffer, WIDTH, HEIGHT, "screenshot.bmp");
+	scene.models.push_back (Model ("res/sphere", { 2.5f, 0.5f, 1.5f }, { 0.1f, 1.0f, 0.5f }));
+	scene.models.push_back (Model ("res/bunny", { 0.0f, 0.0f, 0.0f }, { 0.1f, 0.8f, 0.7f }));
+	scene.models.push_back (Model ("res/cube", { -2.0f, 0.0f, 2.0f }, { 0.3f, 0.8f, 0.8f }));
+	scene.wireframes.push_back (Model ("res/cube", { 4.0f, 1.8f, -2.2f }, { 0.5f, 0.8f, 0.8f }));
+	renderer.SetScene (scene);
+	auto draw = [&] { renderer.DrawScene (scene); };
+
+	if (frames > 0) {
+		// orbit the camera around the scene, frame n is saved as name_000n.ext
+		std::vector<Keyframe> keys;
+		for (int i = 0; i <= 16; i++) {
+			float a = (float)M_PI * 2 * i / 16, r = 5.0f;
+			keys.push_back ({ (float)i, { r * std::sin (a), 3.0f, r * std::cos (a) }, { 0.0f, 0.0f, 0.0f }, renderer.light.pos });
+		}
+		size_t dot = output.rfind ('.');
+		std::string stem = output.substr (0, dot), ext = dot == std::string::npos ? ".bmp" : output.substr (dot);
+		double fps = renderer.RenderFrames (keys, frames, draw, [&] (const ColorBuffer &image, int n) {
+			char num[16];
+			snprintf (num, sizeof (num), "_%04d", n);
+			SaveImage (image, stem + num + ext);
+		}, buffers);
+		printf ("%d frames, %.2f fps\n", frames, fps);
+		return 0;
+	}
+
+	draw ();
+
+	// shade the visibility buffer, does nothing in forward mode
+	renderer.Resolve ();
+
+	// save the frame buffer, the format follows the file extension
+	SaveImage (renderer.frameBuffer, output);
+
+	if (!heatMap.empty ()) {
+		if (COBRA_STATS) SaveImage (renderer.HeatMapImage (), heatMap);
+		else printf ("-heatmap needs a build with COBRA_STATS=1\n");
+	}
+	if (printStats) {
+		const Renderer::RenderStats &s = renderer.stats;
+		printf ("models: %lld drawn, %lld culled, %lld occluded\nvertices shaded: %lld\n", s.modelsDrawn, s.modelsCulled, s.modelsOccluded, s.verticesShaded);
+		if (s.meshletsDrawn + s.meshletsOutside + s.meshletsBackface)
+			printf ("meshlets: %lld drawn, %lld outside, %lld backface\n", s.meshletsDrawn, s.meshletsOutside, s.meshletsBackface);
+		printf ("triangles: %lld submitted, %lld outside, %lld backface, %lld clipped, %lld occluded, %lld rasterized\n",
+			s.trianglesSubmitted, s.trianglesOutside, s.trianglesBackface, s.trianglesClipped, s.trianglesOccluded, s.trianglesRasterized);
+		if (COBRA_STATS) {
+			printf ("blocks occluded: %lld\npixels: %lld tested, %lld covered, %lld depth rejected, %lld shaded, overdraw %.2f\ntexture samples: %lld\n",
+				s.blocksOccluded, s.pixelsTested, s.pixelsCovered, s.pixelsDepthRejected, s.pixelsShaded, renderer.Overdraw (), s.textureSamples);
+		}
+		printf ("time: vertex %.2f ms, raster %.2f ms, shade %.2f ms\n", s.vertexTime * 1e3, s.rasterTime * 1e3, s.shadeTime * 1e3);
+	}
 	return 0;
 }
+#endif // COBRA_NO_MAIN
@@ -0,0 +1,31 @@
+// cobra_convert: turns an obj file into the binary mesh format(.cmesh). the vertices are welded and the triangles
+// split into meshlets here, once, so loading is a plain copy and Model picks up "name.cmesh" next to "name.obj".
+#define COBRA_NO_MAIN
+#include "cobra.cpp"
+
+int main (int argc, char *argv[]) {
+	if (argc < 2) {
+		printf ("usage: cobra_convert input.obj [output.cmesh]\n");
+		return 1;
+	}
+	std::string input = argv[1], output = argc > 2 ? argv[2] : input.substr (0, input.rfind ('.')) + ".cmesh";
+
+	auto start = std::chrono::steady_clock::now ();
+	Mesh mesh (input);
+	if (mesh.indexBuffer.empty ()) {
+		printf ("%s: no triangles\n", input.c_str ());
+		return 1;
+	}
+	mesh.BuildMeshlets ();
+	if (!mesh.SaveBinary (output)) {
+		printf ("%s: write failed\n", output.c_str ());
+		return 1;
+	}
+	double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+
+	size_t culled = 0;
+	for (auto &m : mesh.meshlets) culled += m.cone.w <= 1.0f;
+	printf ("%s: %zu vertices, %zu triangles, %zu meshlets(%.1f triangles each, %zu can be backface culled), %.2f s\n", output.c_str (),
+		mesh.posBuffer.size (), mesh.indexBuffer.size () / 3, mesh.meshlets.size (), mesh.indexBuffer.size () / 3.0 / mesh.meshlets.size (), culled, seconds);
+	return 0;
+}